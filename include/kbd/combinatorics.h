@@ -1,38 +1,95 @@
 ﻿#pragma once
 
 #include <vector>
+#include <array>
+#include <cstdint>
 
 namespace kbd
 {
 
+	//-------------------------------------------------------------------------
+	enum NumberOrder
+	{
+		NUMBER_COUNTING, // Обычный счет: младшая цифра увеличивается, при переполнении идет перенос в старшие
+		NUMBER_GRAY // Код Грея со смешанным основанием: на каждом шаге меняется ровно одна цифра, на единицу
+	};
+
 	//-------------------------------------------------------------------------
 	/** Число на основе какой-либо системы счисления. Система счисления может быть переменной для каждой цифры. */
 	/** Использование:
 
 		Number num(...);
 		do {
-			auto mas = num.get();
+			const auto& mas = num.get();
 			// code
 			num++;
 		} while (!num.isEnd());
 
 	*/
+	/** В порядке NUMBER_GRAY getChangedDigit() говорит, какая единственная цифра поменялась на последнем шаге, поэтому вызывающий код может обновить только то, что от неё зависит. В порядке NUMBER_COUNTING это самая старшая из поменявшихся цифр, а все цифры младше неё стали нулями. До первого шага возвращается -1. */
 	class Number
 	{
 	public:
-		Number(int base, int count);
-		Number(const std::vector<int>& base);
+		Number(int base, int count, NumberOrder order = NUMBER_COUNTING);
+		Number(const std::vector<int>& base, NumberOrder order = NUMBER_COUNTING);
 
 		Number& operator++(int);
 		bool isEnd(void) const;
 
-		std::vector<int> get(void) const;
+		const std::vector<int>& get(void) const;
+		int getChangedDigit(void) const;
 	private:
+		void initGray(void);
+
 		std::vector<int> 	m_mas;
 		std::vector<int> 	m_base;
 		bool				m_end;
+		NumberOrder 		m_order;
+		int 				m_changed;
+
+		// Состояние перебора кодом Грея (алгоритм H из 4 тома Кнута). Цифры с основанием меньше 2 никогда не меняются и в перебор не входят.
+		std::vector<int> 	m_active; // Номера цифр, которые меняются
+		std::vector<int> 	m_focus;
+		std::vector<int> 	m_direction;
+	};
+
+	//-------------------------------------------------------------------------
+	/** Таблица всех композиций чисел до COMPOSITIONS_TABLE_SUM, считается при компиляции. Композиция числа sum с маской разрезов splits лежит по индексу 2^(sum-1) - 1 + splits. */
+	const int COMPOSITIONS_TABLE_SUM = 8;
+
+	struct TableComposition
+	{
+		unsigned char count;
+		unsigned char parts[COMPOSITIONS_TABLE_SUM];
 	};
 
+	typedef std::array<TableComposition, (1 << COMPOSITIONS_TABLE_SUM) - 1> CompositionsTable;
+
+	constexpr CompositionsTable makeCompositionsTable(void) {
+		CompositionsTable table{};
+		for (int sum = 1; sum <= COMPOSITIONS_TABLE_SUM; ++sum) {
+			for (std::uint64_t splits = 0; splits < (std::uint64_t(1) << (sum - 1)); ++splits) {
+				TableComposition& composition = table[(1 << (sum - 1)) - 1 + splits];
+				int size = 1;
+				for (int i = 0; i < sum - 1; ++i) {
+					if (splits & (std::uint64_t(1) << i)) {
+						composition.parts[composition.count++] = size;
+						size = 1;
+					} else
+						size++;
+				}
+				composition.parts[composition.count++] = size;
+			}
+		}
+		return table;
+	}
+
+	inline constexpr CompositionsTable compositionsTable = makeCompositionsTable();
+
+	constexpr const TableComposition& getTableComposition(int sum, std::uint64_t splits) {
+		return compositionsTable[(1 << (sum - 1)) - 1 + splits];
+	}
+
 	//-------------------------------------------------------------------------
 	/** Перебор всех возможных сумм композиций числа. 
 		Пример: все композиции числа 5
@@ -57,23 +114,40 @@ namespace kbd
 
 		Compositions comp(...);
 		do {
-			auto mas = comp.get();
-			// code
+			const unsigned char* parts = comp.getParts();
+			for (int i = 0; i < comp.getPartsCount(); ++i) {
+				// code
+			}
 			comp++;
 		} while (!comp.isEnd());
 
 	*/
+	/** Композиция задается маской разрезов в одном машинном слове: бит i установлен, если между элементами i и i+1 проходит граница части. Переход к следующей композиции — это уменьшение маски на единицу, а части для небольших чисел берутся из заранее посчитанной таблицы, поэтому перебор не выделяет память. Для больших чисел части обновляются на месте: уменьшение маски меняет только первые части, поэтому переход занимает амортизированное O(1), как и счётчик. */
 	class Compositions
 	{
 	public:
-		Compositions(int sum);
+		Compositions(int sum); // sum от 1 до 64
 
 		Compositions& operator++(int);
 		bool isEnd(void) const;
 
 		std::vector<int> get(void) const;
+
+		std::uint64_t getSplits(void) const;
+		int getPartsCount(void) const;
+		const unsigned char* getParts(void) const;
 	private:
-		Number m_num;
+		int 						m_sum;
+		std::uint64_t 				m_splits;
+		bool 						m_end;
+		const TableComposition*		m_table; // Композиция из таблицы, nullptr если части лежат в m_buffer
+		int 						m_partsCount;
+		int 						m_offset; // Части лежат в конце m_buffer, начиная с m_offset, чтобы первые части можно было менять на месте
+		unsigned char 				m_buffer[64];
 	};
 
+	//-------------------------------------------------------------------------
+	// Записывает в parts размеры частей композиции числа sum с маской разрезов splits, возвращает число частей. В parts должно помещаться sum элементов.
+	int getCompositionParts(int sum, std::uint64_t splits, unsigned char* parts);
+
 };
\ No newline at end of file
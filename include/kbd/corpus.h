@@ -0,0 +1,122 @@
+﻿#pragma once
+
+#include <vector>
+#include <string>
+#include <string_view>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <cstdint>
+
+#include <kbd/keyboard.h>
+
+namespace kbd
+{
+
+	//-------------------------------------------------------------------------
+	/** Создаёт нового наборщика. Наборщик хранит положение рук между вызовами type, поэтому каждому потоку нужен свой. */
+	typedef std::function<std::unique_ptr<Typer>(void)> TyperFactory;
+
+	/** Результат набора корпуса текста. */
+	struct CorpusTyping
+	{
+		double 		time; // Сумма времён всех кусков
+		long long 	typedSize; // Сколько символов набрано
+		int 		chunksCount;
+		int 		failedChunksCount; // Сколько кусков не удалось набрать до конца
+		int 		retypedChunksCount; // Сколько кусков пришлось набрать заново, потому что перед ними физическое состояние было не начальным
+	};
+
+	/** Делит текст на куски примерно по chunkSize символов. Текст проходится по тем же частям, что и в typeText с этим maxOneHandSize, и кусок заканчивается только на границе части, сразу после пробельных символов. Поэтому ни одна клавиша, даже с выводом вроде " - ", не пересекает границу куска, а части внутри куска те же, что при наборе всего текста. Возвращает начала кусков, последний элемент — длина текста. */
+	std::vector<int> splitToChunks(
+		const Layout& layout,
+		const std::wstring& text,
+		int maxOneHandSize,
+		int chunkSize
+	);
+
+	/** Набирает корпус текста функцией typeText по кускам из splitToChunks в threadsCount потоках (0 — по числу ядер). Каждый кусок набирается новым наборщиком, сначала параллельно из начального состояния PhysicalState(defaultLayer). Затем куски проверяются по порядку: если предыдущий кусок закончился не в начальном состоянии (остался однократно включённый слой, как после `. ①`, или зажатая клавиша слоя), кусок набирается заново из настоящего состояния. Поэтому для наборщика, который не помнит прошлые вызовы type, результат тот же, что у typeText по всему тексту, только после куска, который не удалось набрать, следующий кусок начинается с начального состояния. Времена кусков складываются по порядку кусков, так что результат побитово одинаков при любом числе потоков. */
+	CorpusTyping typeCorpus(
+		const TyperFactory& makeTyper,
+		const std::wstring& text,
+		int maxOneHandSize,
+		int defaultLayer,
+		int chunkSize,
+		int threadsCount = 0
+	);
+
+	//-------------------------------------------------------------------------
+	/** Самый дешевый способ набрать слово целиком: перебираются все варианты клавиш (KeyLattice), нажатий (decomposeToTaps) и для каждого ищется лучшее разложение на аккорды (decomposeToAccords с AccordCost). Возвращает стоимость, бесконечность, если слово набрать нельзя. */
+	double decomposeWord(
+		const Layout& layout,
+		std::wstring_view word,
+		const PhysicalState& state,
+		const AccordCost& cost,
+		Accords& accords
+	);
+
+	/** Лучшее разложение слова вместе с его стоимостью. */
+	struct WordPlan
+	{
+		Accords accords;
+		double 	cost;
+	};
+
+	/** Кэш результатов decomposeWord для одной функции стоимости. Ключ — отпечаток раскладки (Layout::getFingerprint), физическое состояние перед словом (в нём текущий слой и занятые пальцы) и само слово, поэтому один кэш можно делить между разными раскладками и наборщиками. Число слов ограничено, при переполнении вытесняется давно не использованное слово (алгоритм CLOCK). Можно вызывать из нескольких потоков. */
+	/** Использование:
+
+		WordsCache cache(cost, 100000);
+		for (...) {
+			WordPlan plan = cache.get(layout, word, state);
+			// code
+		}
+
+	*/
+	class WordsCache
+	{
+	public:
+		WordsCache(const AccordCost& cost, int capacity);
+
+		/** Возвращает план из кэша, а если его там нет, то считает через decomposeWord и запоминает. */
+		WordPlan get(const Layout& layout, std::wstring_view word, const PhysicalState& state);
+
+		int size(void) const;
+		int getCapacity(void) const;
+		long long getHitsCount(void) const;
+		long long getMissesCount(void) const;
+		void clear(void);
+
+	private:
+		struct WordKey
+		{
+			std::uint64_t 	fingerprint;
+			PhysicalState 	state;
+			std::wstring 	word;
+
+			bool operator==(const WordKey& other) const;
+		};
+
+		struct WordKeyHash
+		{
+			std::size_t operator()(const WordKey& key) const;
+		};
+
+		struct Entry
+		{
+			WordKey 	key;
+			WordPlan 	plan;
+			bool 		referenced; // Стрелка CLOCK пропускает запись, к которой обращались после прошлого прохода
+		};
+
+		AccordCost 									m_cost;
+		int 										m_capacity;
+		mutable std::mutex 							m_mutex;
+		std::vector<Entry> 							m_entries;
+		std::unordered_map<WordKey, int, WordKeyHash> m_index; // Номер записи в m_entries
+		int 										m_hand; // Стрелка CLOCK
+		long long 									m_hits;
+		long long 									m_misses;
+	};
+
+}
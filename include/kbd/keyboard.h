@@ -3,7 +3,13 @@
 #include <vector>
 #include <map>
 #include <string>
+#include <string_view>
 #include <optional>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <cstdint>
 
 namespace kbd
 {
@@ -59,6 +65,11 @@ namespace kbd
 	struct Key {int layer; KeyPos key;}; // Позиция клавиши в раскладке, включает в себя слой, на котором нажимается клавиша
 	typedef std::vector<KeyPos> Accord; // Это аккорд, и здесь выбрано именно расположение клавиши без слоя, потому что в реальности нажатие аккорда представляет из себя только нажатие реальных клавиш, слои и всё такое дело есть только в голове человека и в микросхеме клавиатуры.
 
+	// Номер конкретного пальца от 0 до 9: сначала пальцы левой руки от мизинца, потом правой. Для HAND_ANY или FINGER_ANY возвращает NO_FINGER_ID.
+	const int NO_FINGER_ID = 0xFFFF;
+	const int FINGERS_COUNT = 10;
+	int getFingerId(Hand hand, Finger finger);
+
 	typedef std::vector<KeyPos> KeyPoses;
 	typedef std::vector<Tap> Taps;
 	typedef std::vector<Key> Keys;
@@ -98,21 +109,53 @@ namespace kbd
 		std::pair<int, int>	getSize(KeyPos key) const;
 		double				getAngle(KeyPos key) const;
 
-		// По руке, пальцу, ряду, колонкам можно получить все клавиши
-		KeyPoses getKeys(Hand hand,
-						 Finger finger,
-						 Row row,
-						 Column column) const;
+		// По руке, пальцу, ряду, колонкам можно получить все клавиши. Ответы на все сочетания, включая любые *_ANY, считаются в конструкторе, поэтому запрос не перебирает клавиши.
+		const KeyPoses& getKeys(Hand hand,
+								Finger finger,
+								Row row,
+								Column column) const;
 
 		std::vector<KeyboardKey> getKeyboardInnerFormat(void) const;
 
+		/** Те же свойства клавиш, но в виде плотных массивов по KeyPos: по одному байту на руку, палец, ряд и колонку, и номер пальца из getFingerId. Нужны для внутренних циклов разложения и наборщиков, где геометрия клавиш не нужна. */
+		const std::uint8_t*		getHands(void) const;
+		const std::uint8_t*		getFingers(void) const;
+		const std::uint8_t*		getRows(void) const;
+		const std::uint8_t*		getColumns(void) const;
+		const std::uint16_t*	getFingerIds(void) const;
+
+		/** Маски разрезов (как в Compositions) всех допустимых разложений клавиш одной руки на аккорды. Допустимость разложения зависит только от последовательности пальцев, поэтому результат запоминается по этой последовательности и для клавиатуры считается один раз. Можно вызывать из нескольких потоков. */
+		const std::vector<std::uint64_t>& getOneHandAccordsSplits(const KeyPoses& keyPoses) const;
+
+		// Самая длинная последовательность клавиш, которая запоминается в getOneHandAccordsSplits. На номер пальца из getFingerIds уходит 4 бита ключа.
+		static const int MAX_CACHED_ACCORDS_SIZE = 15;
+
 	private:
-		std::string 				m_name;
-		std::vector<KeyboardKey> 	m_keys;
+		struct AccordsCache
+		{
+			std::mutex 													mutex;
+			std::unordered_map<std::uint64_t, std::vector<std::uint64_t>> 	splits;
+		};
+
+		void initAttributes(void);
+		void initKeysIndex(void);
+
+		static int getKeysIndex(int hand, int finger, int row, int column);
+
+		std::string 					m_name;
+		std::vector<KeyboardKey> 		m_keys;
+		std::vector<std::uint8_t> 		m_hands;
+		std::vector<std::uint8_t> 		m_fingers;
+		std::vector<std::uint8_t> 		m_rows;
+		std::vector<std::uint8_t> 		m_columns;
+		std::vector<std::uint16_t> 		m_fingerIds;
+		std::vector<KeyPoses> 			m_keysIndex; // Ответы getKeys для каждого сочетания руки, пальца, ряда и колонки
+		std::shared_ptr<AccordsCache> 	m_accordsCache;
 	};
 
 	//-------------------------------------------------------------------------
 	/** Показывает физическое состояние печатальщика и клавиатуры. Оно характеризуется занятыми пальцами, а так же текущий слой у клавиатуры. */
+	/** Состояние хранится в массивах фиксированного размера без выделения памяти: его можно копировать через memcpy, сравнивать и использовать как ключ хэш-таблицы. */
 	class PhysicalState
 	{
 	public:
@@ -130,15 +173,94 @@ namespace kbd
 		// Занимает палец на заданной клавише, при этом включается слой layer
 		void busyFinger(Hand hand, Finger finger, KeyPos key, int layer);
 		
-		// Отпускает палец. При этом из стека пропадает слой, связанный с этим пальцем
+		// Отпускает палец. При этом из стека пропадает слой, связанный с этим пальцем. Возвращает false, если палец не был занят
 		bool unbusyFinger(Hand hand, Finger finger);
 
+		// Маска занятых пальцев, бит с номером getFingerId
+		std::uint16_t getBusyMask(void) const;
+
+		bool operator==(const PhysicalState& other) const;
+		bool operator!=(const PhysicalState& other) const;
+		std::size_t getHash(void) const;
+
+	private:
+		struct LayerStackItem
+		{
+			std::uint16_t 	fingerId; // NO_FINGER_ID для слоя по умолчанию
+			std::int16_t 	layer;
+		};
+
+		std::uint16_t 		m_busyMask;
+		KeyPos 				m_busyKeys[FINGERS_COUNT]; // Клавиша, которой занят палец, 0 для свободного пальца
+		// Каждый палец держит не больше одного слоя, поэтому стек не длиннее числа пальцев и слоя по умолчанию
+		LayerStackItem 		m_layerStack[FINGERS_COUNT + 1];
+		std::uint8_t 		m_layerStackSize;
+		mutable bool 		m_isOneTap;
+		std::int16_t 		m_oneTapLayer;
+	};
+
+	//-------------------------------------------------------------------------
+	enum TypeError
+	{
+		TYPE_OK,
+		TYPE_ERROR_BUSY_FINGER_DOWN, // Зажимается клавиша занятым пальцем
+		TYPE_ERROR_NOT_LAYER_KEY_DOWN, // Зажимается клавиша, которая не переключает слой
+		TYPE_ERROR_WRONG_FINGER_UP, // Отпускается клавиша, которая не была зажата
+		TYPE_ERROR_BUSY_FINGER_PRESS // Нажимается клавиша занятым пальцем
+	};
+
+	struct TypeResult
+	{
+		TypeError 	error;
+		long long 	tap; // Номер нажатия с ошибкой, -1 если ошибки нет
+	};
+
+	//-------------------------------------------------------------------------
+	/** Автомат Ахо — Корасик по тому, что печатают клавиши раскладки (без символа переключения слоя). За один проход по тексту находит для каждой позиции все клавиши, чей вывод в ней заканчивается, не сравнивая вывод каждой клавиши с текстом отдельно. Одинаковый вывод нескольких клавиш хранится один раз. */
+	/** Использование:
+
+		int state = matcher.getStartState();
+		for (int end = 0; end < text.size(); ++end) {
+			state = matcher.next(state, text[end]);
+			for (int match = matcher.getFirstMatch(state); match != -1; match = matcher.getNextMatch(match)) {
+				int pos = end + 1 - matcher.getMatchSize(match);
+				const Keys& keys = matcher.getMatchKeys(match);
+				// code
+			}
+		}
+
+	*/
+	class OutputsMatcher
+	{
+	public:
+		OutputsMatcher();
+		OutputsMatcher(const std::vector<std::pair<std::wstring_view, Key>>& outputs);
+
+		int getStartState(void) const;
+		int next(int state, wchar_t letter) const;
+
+		// Самый длинный вывод, который заканчивается в этом состоянии, -1 если таких нет
+		int getFirstMatch(int state) const;
+		// Следующий по длине вывод, который заканчивается там же, -1 если таких нет
+		int getNextMatch(int match) const;
+		int getMatchSize(int match) const;
+		const Keys& getMatchKeys(int match) const;
+
+		// Длина самого длинного вывода, 0 если выводов нет
+		int getMaxMatchSize(void) const;
+
 	private:
-		typedef int FingerId;
-		std::map<std::pair<Hand, Finger>, std::optional<KeyPos>> busyFingers;
-		std::vector<std::pair<FingerId, int>> 					 layerStack;
-		mutable bool 											 isOneTap;
-		int 													 oneTapLayer;
+		// Переход из вершины state по символу, -1 если его нет
+		int getEdge(int state, wchar_t letter) const;
+
+		std::vector<int> 			m_edgeBegin; // Рёбра вершины i лежат в m_edgeLetters[m_edgeBegin[i]..m_edgeBegin[i+1]), отсортированы по символу
+		std::vector<wchar_t> 		m_edgeLetters;
+		std::vector<int> 			m_edgeTargets;
+		std::vector<int> 			m_fail; // Вершина самого длинного собственного суффикса
+		std::vector<int> 			m_nextMatch; // Ближайшая по суффиксным ссылкам вершина, где заканчивается вывод
+		std::vector<int> 			m_depth;
+		std::vector<Keys> 			m_keys; // Клавиши, вывод которых заканчивается в вершине
+		int 						m_maxMatchSize;
 	};
 
 	//-------------------------------------------------------------------------
@@ -156,27 +278,114 @@ namespace kbd
 			   const std::vector<LayoutSymbols>& symbols);
 
 		// Возвращает набор символов, которые будут при нажатии определенной клавиши на определенном слое
-		const std::wstring& getSymbols(Key key) const; 
+		std::wstring_view 	getSymbols(Key key) const; 
+		// То же самое, но без последнего символа переключения слоя, то есть только то, что реально напечатается
+		std::wstring_view 	getOutput(Key key) const;
+		// Слой, который клавиша включает после себя (последний символ вроде ①), или -1, если не включает
+		int 				getNextLayer(Key key) const;
+		// Клавиша только переключает слой и ничего не печатает
+		bool 				isLayerKey(Key key) const;
+		// Возвращает все клавиши, набор которых начинается с этого символа. Если таких нет, то возвращает пустой массив.
 		const Keys& 		getKeys(wchar_t letter) const;
+		// Автомат для поиска в тексте всех мест, где можно нажать какую-либо клавишу
+		const OutputsMatcher& getMatcher(void) const;
 
-		/** Возвращает минимальную последовательность нажатий, чтобы включить некоторый слой. */
+		int getLayersCount(void) const;
+
+		/** Хэш клавиатуры и символов всех клавиш. У раскладок, которые одинаково набирают текст на одинаковой клавиатуре, он совпадает, поэтому по нему можно делить кэши между копиями раскладки. */
+		std::uint64_t getFingerprint(void) const;
+
+		/** Возвращает последовательности нажатий, чтобы включить некоторый слой, в порядке возрастания длины: первая из них минимальная. Хранится не больше MAX_LAYER_KEYS_VARIANTS самых коротких последовательностей. */
 		const std::vector<KeyPoses>& getLayerKeys(int currentLayer, int toLayer) const;
+		static const int MAX_LAYER_KEYS_VARIANTS = 8;
 
 		/** Эмулирует нажатие клавиш, возвращает какой текст напишется в итоге. */
 		/** Особенность: тут передаются только нажатия и зажатия клавиш, тут может быть зажата какая-то клавиша, чтобы включить слой. */
 		std::wstring typeTaps(const Taps& taps, PhysicalState& state) const;
+		/** То же самое, но без исключений: текст дописывается в конец output, а при ошибке возвращается её код и номер нажатия, на котором она произошла. Нажатия до ошибки уже применены к state и output. */
+		TypeResult typeTaps(const Taps& taps, PhysicalState& state, std::wstring& output) const;
+		TypeResult typeTaps(const Tap* taps, int count, PhysicalState& state, std::wstring& output) const;
 		/** Особенность: тут передаются только одиночные нажатия, переключение слоя не учитывается. Соответственно не может быть занятых пальцев, текущего слоя и других частей физического состояния. */
 		std::wstring typeKeys(const Keys& keys) const;
 
 		const std::vector<LayoutSymbols>& getLayoutInnerFormat(void) const;
 
 	private:
+		// Номер символа в плотном массиве: латиница, греческий, кириллица и ASCII-пунктуация (до U+0500), а также общая пунктуация (U+2000..U+206F). Для остальных символов -1.
+		static int getDenseSlot(wchar_t letter);
+
 		std::vector<LayoutSymbols> 								m_symbols;
-		std::vector<std::vector<std::wstring>> 					m_layerMas;
-		std::map<wchar_t, Keys>									m_keyMap;
-		std::map<std::pair<int, int>, std::vector<KeyPoses>>	m_layerMap;
+		// Символы всех клавиш лежат подряд в одной строке, одинаковые наборы символов хранятся один раз. Для клавиши на слое layer диапазон лежит по индексу layer * size() + key.
+		struct SymbolsRange
+		{
+			std::uint32_t 	offset;
+			std::uint16_t 	size; // Без символа переключения слоя
+			std::int16_t 	nextLayer; // -1, если клавиша не переключает слой
+		};
+
+		const SymbolsRange& getSymbolsRange(Key key) const;
+
+		int 													m_layersCount;
+		std::uint64_t 											m_fingerprint;
+		std::wstring 											m_symbolsBuffer;
+		std::vector<SymbolsRange> 								m_symbolsIndex;
+		// Клавиши для каждого символа. Для символов из getDenseSlot номер в m_keyLists хранится прямо в массиве по символу, для остальных — в хэш-таблице. Номер хранится +1, 0 означает, что клавиш нет.
+		std::vector<Keys> 										m_keyLists;
+		std::vector<std::uint32_t> 								m_denseKeyIndex;
+		std::unordered_map<wchar_t, std::uint32_t> 				m_sparseKeyIndex;
+		OutputsMatcher 											m_matcher;
+		// Переходы со слоя a на слой b лежат по индексу a * m_layersCount + b
+		std::vector<std::vector<KeyPoses>> 						m_layerKeys;
+	};
+
+	//-------------------------------------------------------------------------
+	/** Получает очередной кусок напечатанного текста. Строка действительна только во время вызова. */
+	typedef std::function<void(std::wstring_view)> TextSink;
+
+	/** Заполняет taps следующей порцией нажатий. Возвращает false, когда нажатия закончились. */
+	typedef std::function<bool(Taps& taps)> TapsSource;
+
+	/** Набор потока нажатий, который не помещается в память целиком. Нажатия подаются порциями, физическое состояние сохраняется между порциями, а текст каждой порции передаётся в sink одним куском через переиспользуемый буфер. Раскладка должна жить дольше потока. */
+	/** Использование:
+
+		TapsStream stream(layout, PhysicalState(0), sink);
+		while (...) {
+			if (stream.write(taps).error != TYPE_OK)
+				break;
+		}
+
+	*/
+	class TapsStream
+	{
+	public:
+		TapsStream(const Layout& layout, const PhysicalState& state, const TextSink& sink);
+
+		/** Набирает порцию нажатий. Номер нажатия в ошибке считается от начала потока. После ошибки поток останавливается и возвращает ту же ошибку на все следующие порции. */
+		TypeResult write(const Tap* taps, int count);
+		TypeResult write(const Taps& taps);
+
+		const PhysicalState& getState(void) const;
+		// Число успешно набранных нажатий
+		long long getTapsCount(void) const;
+		TypeResult getResult(void) const;
+
+	private:
+		const Layout& 	m_layout;
+		PhysicalState 	m_state;
+		TextSink 		m_sink;
+		std::wstring 	m_buffer;
+		long long 		m_tapsCount;
+		TypeResult 		m_result;
 	};
 
+	// Набирает все нажатия из source, текст передаётся в sink
+	TypeResult typeTaps(
+		const Layout& layout,
+		const TapsSource& source,
+		PhysicalState& state,
+		const TextSink& sink
+	);
+
 	//-------------------------------------------------------------------------
 	// Раскладывает первую минимально возможную часть на все возможные варианты нажатия клавиш со слоём в заданной раскладке. Именно здесь выбирается сколько символов будет набрано за одну итерацию алгоритма. Потому что только в этой итерации можно рассмотреть все варианты, чтобы среди них выбрать самый оптимальный, который не повлияет на следующие итерации.
 	std::vector<Keys> decomposeToKeys(
@@ -186,13 +395,44 @@ namespace kbd
 		int& symbolsCount
 	);
 
-	// Раскладывает нажатие клавиш со слоём на все возможные нажатия кнопок на клавиатуре. Тут уже учитывается физическое состояние (слой и занятые пальцы).
+	// Раскладывает нажатие клавиш со слоём на нажатия кнопок на клавиатуре. Тут уже учитывается физическое состояние (слой и занятые пальцы). Само состояние не меняется. Все варианты не перебираются: возвращается один вариант с наименьшим числом нажатий или пустой массив, если клавиши набрать нельзя.
 	std::vector<Taps> decomposeToTaps(
 		const Layout& layout,
 		const Keys& keys,
 		PhysicalState& state
 	);
 
+	/** Стоимость одного нажатия, должна быть неотрицательной. */
+	typedef std::function<double(const Tap&)> TapCost;
+
+	// Применяет одно нажатие к state так же, как typeTaps. Возвращает false, если нажатие недопустимо или печатает не expected, тогда state не определён.
+	bool applyTap(
+		const Layout& layout,
+		Tap tap,
+		std::wstring_view expected,
+		PhysicalState& state
+	);
+
+	/** Вызывается для допустимого нажатия вместе с состоянием после него. */
+	typedef std::function<void(const Tap& tap, const PhysicalState& next)> TapTransitionVisitor;
+
+	// Перебирает допустимые из state нажатия, которые ничего не печатают: однократные нажатия и зажатия клавиш слоя на текущем слое, если isSwitchLayer, и отпускания всех зажатых клавиш. Это общие переходы поиска в decomposeToTaps и typeTextOptimal.
+	void visitSilentTaps(
+		const Layout& layout,
+		const PhysicalState& state,
+		bool isSwitchLayer,
+		const TapTransitionVisitor& visitor
+	);
+
+	/** Нажатия с минимальной суммарной стоимостью, которые набирают клавиши keys из состояния state. Слой можно включить однократным нажатием клавиши слоя или зажать её (PRESS_DOWN) и отпустить позже (PRESS_UP), когда палец понадобится или слой станет не нужен. Выбор делается динамическим программированием по вершинам (позиция в keys, физическое состояние), то есть по слою, стеку зажатых слоёв и маске занятых пальцев, — алгоритмом Дейкстры, поэтому варианты не перебираются. Зажатые клавиши в конце не отпускаются, они остаются для следующей части текста. Если набрать нельзя, возвращает пустой массив, а resultCost — бесконечность. */
+	Taps decomposeToTaps(
+		const Layout& layout,
+		const Keys& keys,
+		const PhysicalState& state,
+		const TapCost& cost,
+		double& resultCost
+	);
+
 	// Раскладывает клавиши на одной руке на все возможные аккорды
 	std::vector<Accords> decomposeOneHandAccords(
 		const Keyboard& keyboard, 
@@ -205,6 +445,59 @@ namespace kbd
 		const KeyPoses& keyPoses
 	);
 
+	// Стоимость набора одного аккорда
+	typedef std::function<double(const Accord&)> AccordCost;
+
+	//-------------------------------------------------------------------------
+	/** Все варианты набора клавиш аккордами, как в decomposeToAccords, но без построения их произведения. Клавиши разбиваются на части одной руки, и для каждой части хранятся её разложения; вариант — это выбор одного разложения для каждой части. Вариантов столько, сколько произведение числа разложений частей, а памяти нужно только на их сумму. Номер варианта — это число со смешанным основанием, где младшая цифра соответствует первой части, как в Number. */
+	class AccordsVariants
+	{
+	public:
+		AccordsVariants(const Keyboard& keyboard, const KeyPoses& keyPoses);
+
+		/** Число вариантов. Если оно не помещается в long long, то возвращается максимальное значение long long. */
+		long long size(void) const;
+
+		int getPartsCount(void) const;
+		const std::vector<Accords>& getPart(int part) const;
+
+		/** Вариант с заданным номером. Вторая версия пишет в переданный массив, чтобы не выделять память на каждый вариант. */
+		Accords get(long long index) const;
+		void get(long long index, Accords& result) const;
+
+		/** Лучший вариант, когда стоимость складывается из стоимостей аккордов: тогда для каждой части лучшее разложение выбирается независимо, и произведение не перебирается. */
+		Accords getOptimal(const AccordCost& cost, double& resultCost) const;
+	private:
+		std::vector<std::vector<Accords>> 	m_parts;
+		long long 							m_size;
+	};
+
+	//-------------------------------------------------------------------------
+	/** Статистика поиска методом ветвей и границ. */
+	struct SearchStats
+	{
+		long long visited = 0; // Сколько частичных вариантов было рассмотрено
+		long long pruned = 0; // Сколько из них отброшено, потому что их нижняя оценка не лучше уже найденного варианта
+	};
+
+	// Находит самое дешевое разложение клавиш на одной руке на аккорды, не перебирая все варианты. Стоимость разложения — сумма стоимостей аккордов. Если разложения нет, то resultCost равен бесконечности.
+	Accords decomposeOneHandAccords(
+		const Keyboard& keyboard, 
+		const KeyPoses& keyPoses,
+		const AccordCost& cost,
+		double& resultCost,
+		SearchStats& stats
+	);
+
+	// То же самое для обеих рук. Так как стоимость складывается из стоимостей аккордов, части каждой руки ищутся независимо.
+	Accords decomposeToAccords(
+		const Keyboard& keyboard, 
+		const KeyPoses& keyPoses,
+		const AccordCost& cost,
+		double& resultCost,
+		SearchStats& stats
+	);
+
 	//-------------------------------------------------------------------------
 	/** Набирает текст прямо сейчас. */
 	class Typer
@@ -218,6 +511,8 @@ namespace kbd
 
 		/** Набирает заданное число аккордов. Результатом является то, что набираются некоторые символы, при этом у наборщика двигаются руки в необходимую позицию. Так же возвращает время набора. */
 		virtual double type(const Accords& accords) = 0;
+
+		const Layout& getLayout(void) const;
 	protected:
 		Layout m_layout;
 	};
@@ -252,6 +547,23 @@ namespace kbd
 		double type(const Accords& accords);
 	};
 
+	//-------------------------------------------------------------------------
+	/** Результат набора всего текста. */
+	struct TextTyping
+	{
+		double 	time; // Сумма времён, которые вернул Typer::type
+		Accords accords; // Выбранные аккорды всех частей подряд
+		int 	typedSize; // Сколько символов текста набрано. Меньше длины текста, если дальше текст набрать нельзя
+	};
+
+	/** Набирает весь текст по частям: первая часть раскладывается на клавиши (decomposeToKeys), дополняется нажатиями для переключения слоёв (decomposeToTaps), раскладывается на аккорды (decomposeToAccords), из всех вариантов выбирается лучший (Typer::getOptimalAccords), он набирается (Typer::type и Layout::typeTaps), после чего то же самое делается с остатком текста. Буферы всех этапов переиспользуются между частями. Бросает исключение, если maxOneHandSize меньше 1 или getOptimalAccords вернул номер вне массива. */
+	TextTyping typeText(
+		Typer& typer,
+		const std::wstring& text,
+		int maxOneHandSize,
+		PhysicalState& state
+	);
+
 	//-------------------------------------------------------------------------
 	void saveToFile(const Keyboard& keyboard, std::string keyboardFile);
 	void readFromFile(Keyboard& keyboard, std::string keyboardFile);
@@ -278,6 +590,22 @@ namespace kbd
 	*/
 
 	//-------------------------------------------------------------------------
+	/** Число слоёв, для которых есть специальные символы: ⓪, ①..⑳, ㉑..㉟, ㊱..㊿. */
+	const int MAX_LAYERS_COUNT = 51;
+
 	std::optional<int> getLayer(wchar_t symbol); // Определят номер слоя по специальным символам
+	wchar_t getLayerSymbol(int layer); // Обратно к getLayer, бросает исключение, если для слоя нет символа
 
-}
\ No newline at end of file
+	/** Находит все символы слоёв в тексте. Бит i%64 элемента i/64 установлен, если text[i] — символ слоя. */
+	std::vector<std::uint64_t> getLayerMarkers(const std::wstring& text);
+
+}
+
+//-----------------------------------------------------------------------------
+template<>
+struct std::hash<kbd::PhysicalState>
+{
+	std::size_t operator()(const kbd::PhysicalState& state) const {
+		return state.getHash();
+	}
+};
@@ -0,0 +1,232 @@
+﻿#pragma once
+
+#include <vector>
+#include <string>
+#include <string_view>
+#include <functional>
+
+#include <kbd/keyboard.h>
+
+namespace kbd
+{
+
+	//-------------------------------------------------------------------------
+	/** Стоимость нажатия клавиши со слоем. */
+	typedef std::function<double(const Key&)> KeyCost;
+
+	/** Полная стоимость готового варианта набора. */
+	typedef std::function<double(const Keys&)> KeysCost;
+
+	//-------------------------------------------------------------------------
+	/** Все места текста, где вывод клавиши совпадает с текстом, разложенные по позиции начала. Находятся одним проходом автомата Layout::getMatcher, а раскладываются сортировкой подсчётом. Память переиспользуется между текстами. */
+	/** Использование:
+
+		TextMatches matches;
+		matches.assign(layout.getMatcher(), text);
+		for (int i = matches.getBegin(pos); i < matches.getEnd(pos); ++i) {
+			int match = matches.get(i);
+			// code
+		}
+
+	*/
+	class TextMatches
+	{
+	public:
+		void assign(const OutputsMatcher& matcher, std::wstring_view text);
+
+		// Совпадения с началом в позиции pos имеют номера от getBegin(pos) до getEnd(pos)
+		int getBegin(int pos) const;
+		int getEnd(int pos) const;
+		// Совпадение из OutputsMatcher
+		int get(int i) const;
+
+	private:
+		std::vector<std::pair<int, int>> 	m_found; // Позиция начала и совпадение, нужно только во время раскладки
+		std::vector<int> 					m_begin; // Совпадения с началом в позиции pos лежат в m_matches[m_begin[pos]..m_begin[pos+1])
+		std::vector<int> 					m_matches;
+	};
+
+	//-------------------------------------------------------------------------
+	/** Решётка всех вариантов набора текста клавишами раскладки.
+		Вершина решётки — это позиция в тексте вместе со слоем, на котором обязана находиться следующая клавиша (если предыдущая клавиша автоматически включила слой, как `. ①`). Ребро — это клавиша, символы которой (без переключения слоя) совпадают с текстом в этой позиции. Каждый путь от начала до конца текста — это ровно один вариант набора из decomposeToKeys.
+		Решётка строится за время, линейное по длине текста, а лучший вариант находится по ней без перебора всех вариантов. */
+	/** Использование:
+
+		KeyLattice lattice(layout, text);
+		if (lattice.isTypable()) {
+			double cost;
+			Keys keys = lattice.getOptimal(cost, ...);
+		}
+
+	*/
+	class KeyLattice
+	{
+	public:
+		KeyLattice();
+		/** startLayer — слой, на котором обязана быть первая клавиша, -1 обозначает любой слой. */
+		KeyLattice(const Layout& layout, std::wstring_view text, int startLayer = -1);
+
+		/** Перестраивает решётку для другого текста. Память под вершины и рёбра переиспользуется, поэтому при наборе длинного текста по частям одну решётку лучше перестраивать, а не создавать заново. */
+		void assign(const Layout& layout, std::wstring_view text, int startLayer = -1);
+
+		int getTextSize(void) const;
+
+		/** Можно ли набрать текст целиком. */
+		bool isTypable(void) const;
+
+		/** Число всех вариантов набора. Считается в double, потому что на длинном тексте оно не помещается ни в какое целое. */
+		double getVariantsCount(void) const;
+
+		/** Все варианты набора. Их число экспоненциально от длины текста, поэтому это только для коротких частей. */
+		std::vector<Keys> getAllVariants(void) const;
+
+		/** Вариант с минимальной суммарной стоимостью клавиш. Если текст набрать нельзя, возвращает пустой массив. */
+		Keys getOptimal(const KeyCost& cost, double& resultCost) const;
+
+		/** Вариант с минимальной полной стоимостью cost, найденный методом ветвей и границ. lowerBound — оценка каждой клавиши, сумма которой по варианту не больше его полной стоимости. Частичный вариант отбрасывается, если сумма оценок его клавиш вместе с лучшей суммой оценок до конца текста уже не меньше найденного варианта. */
+		Keys getOptimal(const KeyCost& lowerBound, const KeysCost& cost, double& resultCost, SearchStats& stats) const;
+
+	private:
+		friend class KeyVariants;
+
+		struct Arc
+		{
+			Key key;
+			int to; // Вершина, в которую ведет ребро
+		};
+
+		int getNode(int pos, int layer) const;
+		int getStartNode(void) const;
+		bool isEndNode(int node) const;
+
+		// Для каждой вершины находит минимальную стоимость пути до конца текста и ребро, с которого этот путь начинается
+		void getSuffixCosts(const KeyCost& cost, std::vector<double>& arcCost, std::vector<double>& best, std::vector<int>& choice) const;
+
+		int 				m_textSize;
+		int 				m_layerStates; // Число слоёв + 1, так как есть состояние "любой слой"
+		int 				m_startLayer;
+		std::vector<int> 	m_arcBegin; // Рёбра вершины i лежат в m_arcs[m_arcBegin[i]..m_arcBegin[i+1])
+		std::vector<Arc> 	m_arcs;
+		std::vector<char> 	m_alive; // Из вершины достижим конец текста
+		std::vector<char> 	m_reached; // Вершина достижима из начала, нужно только во время построения
+		TextMatches 		m_matches; // Нужно только во время построения
+	};
+
+	//-------------------------------------------------------------------------
+	/** Перебор вариантов набора из решётки по одному. Все варианты не хранятся: текущий вариант лежит в одном переиспользуемом массиве, а память пропорциональна только длине текста. Перебор можно прервать в любой момент. Решётка должна жить дольше перебора. */
+	/** Использование:
+
+		KeyVariants variants(lattice);
+		while (!variants.isEnd()) {
+			const Keys& keys = variants.get();
+			// code
+			variants++;
+		}
+
+	*/
+	class KeyVariants
+	{
+	public:
+		KeyVariants(const KeyLattice& lattice);
+
+		KeyVariants& operator++(int);
+		bool isEnd(void) const;
+
+		const Keys& get(void) const;
+	private:
+		// Продолжает обход в глубину до следующего конца текста
+		void findNext(void);
+
+		const KeyLattice& 					m_lattice;
+		std::vector<std::pair<int, int>> 	m_stack; // Вершина и номер следующего ребра из неё
+		Keys 								m_keys;
+	};
+
+	//-------------------------------------------------------------------------
+	// Находит первую однорукую часть текста, как это делает decomposeToKeys, и строит по ней решётку. В symbolsCount записывается длина этой части. Часть увеличивается, только пока клавиша с несколькими символами может выходить за её границу; если и так её набрать нельзя, решётка будет ненабираемой.
+	KeyLattice buildFirstPartLattice(
+		const Layout& layout,
+		std::wstring_view text,
+		int maxOneHandSize,
+		int& symbolsCount
+	);
+
+	// То же самое, но решётка перестраивается на месте
+	void buildFirstPartLattice(
+		const Layout& layout,
+		std::wstring_view text,
+		int maxOneHandSize,
+		int& symbolsCount,
+		KeyLattice& lattice
+	);
+
+	/** Вызывается для каждого варианта набора. Если возвращает false, то перебор прекращается. Массив клавиш переиспользуется между вызовами, поэтому его надо копировать, если он нужен после вызова. */
+	typedef std::function<bool(const Keys&)> KeysVisitor;
+
+	// То же, что и decomposeToKeys из keyboard.h, только варианты не складываются в массив, а по одному передаются в visitor. Возвращает false, если перебор был прерван.
+	bool decomposeToKeys(
+		const Layout& layout,
+		const std::wstring& text,
+		int maxOneHandSize,
+		int& symbolsCount,
+		const KeysVisitor& visitor
+	);
+
+	//-------------------------------------------------------------------------
+	/** Стоимость нажатия tap, если предыдущее нажатие было сделано пальцем previousFinger (номер из getFingerId, NO_FINGER_ID перед первым нажатием). Должна быть неотрицательной. */
+	typedef std::function<double(const Tap& tap, int previousFinger)> TapTransitionCost;
+
+	/** Самый дешёвый способ набрать весь текст, начиная с состояния state. В отличие от typeText, который выбирает лучший вариант для каждой однорукой части отдельно, здесь находится оптимум для всего текста сразу.
+		Это алгоритм Витерби по решётке текста: для каждой позиции хранится лучшая стоимость каждого достижимого состояния, то есть физического состояния (слой и занятые пальцы) вместе с пальцем предыдущего нажатия. Из состояния можно нажать клавишу, вывод которой совпадает с текстом в этой позиции, нажать или зажать клавишу слоя или отпустить зажатую клавишу. Отпускание не меняет палец предыдущего нажатия.
+		Время линейно по длине текста. Состояния хранятся только для тех позиций впереди, до которых дотягивается одна клавиша. Обратная ссылка для восстановления пути заводится только для продолжённого состояния, а ссылки, от которых не осталось продолжений, периодически выбрасываются, поэтому их число растёт с длиной найденного пути, а не с числом состояний на позицию. Если текст набрать нельзя, возвращает пустой массив, а resultCost — бесконечность. */
+	Taps typeTextOptimal(
+		const Layout& layout,
+		std::wstring_view text,
+		const PhysicalState& state,
+		const TapTransitionCost& cost,
+		double& resultCost
+	);
+
+	//-------------------------------------------------------------------------
+	/** Статистика поиска с ограниченной шириной луча. */
+	struct BeamStats
+	{
+		long long positions = 0; // Сколько позиций текста было обработано
+		long long truncatedPositions = 0; // В скольких из них луч отбросил хотя бы одно состояние
+		long long dropped = 0; // Сколько всего состояний было отброшено
+		long long settled = 0; // Сколько всего состояний было продолжено
+		long long maxLinks = 0; // Наибольшее число одновременно хранимых обратных ссылок
+	};
+
+	/** То же самое, но в каждой позиции текста продолжаются только beamWidth самых дешёвых состояний, остальные отбрасываются. Время и память на позицию ограничены шириной луча, а не числом всех сочетаний слоёв и зажатых клавиш, зато результат может быть дороже точного или текст может оказаться ненабираемым. beamWidth = 0 означает луч без ограничения, и тогда результат точный. */
+	Taps typeTextOptimal(
+		const Layout& layout,
+		std::wstring_view text,
+		const PhysicalState& state,
+		const TapTransitionCost& cost,
+		int beamWidth,
+		double& resultCost,
+		BeamStats& stats
+	);
+
+	/** Сравнение поиска с лучом и точного поиска на выборке текстов. */
+	struct BeamQuality
+	{
+		int 	samplesCount = 0; // Сколько текстов выборки можно набрать
+		int 	worseCount = 0; // Для скольких из них луч нашёл более дорогой набор
+		int 	failedCount = 0; // Для скольких луч не нашёл набора вообще
+		double 	exactCost = 0; // Суммарная точная стоимость
+		double 	beamCost = 0; // Суммарная стоимость с лучом по тем текстам, где он нашёл набор
+	};
+
+	// Набирает каждый текст выборки точно и с лучом ширины beamWidth и сравнивает стоимости. Тексты, которые нельзя набрать даже точно, пропускаются.
+	BeamQuality compareBeamWithExact(
+		const Layout& layout,
+		const std::vector<std::wstring>& sample,
+		const PhysicalState& state,
+		const TapTransitionCost& cost,
+		int beamWidth,
+		BeamStats& stats
+	);
+
+}
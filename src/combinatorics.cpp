@@ -1,18 +1,52 @@
-﻿#include <kbd/combinatorics.h>
+﻿#include <exception>
+
+#include <kbd/combinatorics.h>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
 
 namespace kbd
 {
 
 //-----------------------------------------------------------------------------
-Number::Number(int base, int count) : m_mas(count, 0), m_base(count, base), m_end(false) {
+Number::Number(int base, int count, NumberOrder order) : m_mas(count, 0), m_base(count, base), m_end(false), m_order(order), m_changed(-1) {
+	if (m_order == NUMBER_GRAY)
+		initGray();
 }
 
 //-----------------------------------------------------------------------------
-Number::Number(const std::vector<int>& base) : m_mas(base.size(), 0), m_base(base), m_end(false) {
+Number::Number(const std::vector<int>& base, NumberOrder order) : m_mas(base.size(), 0), m_base(base), m_end(false), m_order(order), m_changed(-1) {
+	if (m_order == NUMBER_GRAY)
+		initGray();
 }
 
 //-----------------------------------------------------------------------------
 Number& Number::operator++(int) {
+	if (m_order == NUMBER_GRAY) {
+		int j = m_focus[0];
+		m_focus[0] = 0;
+		if (j == m_active.size()) {
+			m_end = true;
+			return *this;
+		}
+
+		int digit = m_active[j];
+		m_mas[digit] += m_direction[j];
+		m_changed = digit;
+		if (m_mas[digit] == 0 || m_mas[digit] == m_base[digit] - 1) {
+			m_direction[j] = -m_direction[j];
+			m_focus[j] = m_focus[j + 1];
+			m_focus[j + 1] = j + 1;
+		}
+		return *this;
+	}
+
+	if (m_mas.empty()) {
+		m_end = true;
+		return *this;
+	}
+
 	m_mas[0]++;
 	int current = 0;
 	while (current < m_base.size() && m_mas[current] >= m_base[current]) {
@@ -23,6 +57,7 @@ Number& Number::operator++(int) {
 	}
 	if (current == m_base.size())
 		m_end = true;
+	m_changed = current;
 	return *this;
 }
 
@@ -32,52 +67,127 @@ bool Number::isEnd(void) const {
 }
 
 //-----------------------------------------------------------------------------
-std::vector<int> Number::get(void) const {
+const std::vector<int>& Number::get(void) const {
 	return m_mas;
 }
 
+//-----------------------------------------------------------------------------
+int Number::getChangedDigit(void) const {
+	return m_changed;
+}
+
+//-----------------------------------------------------------------------------
+void Number::initGray(void) {
+	for (int i = 0; i < m_base.size(); ++i)
+		if (m_base[i] >= 2)
+			m_active.push_back(i);
+
+	m_focus.resize(m_active.size() + 1);
+	for (int i = 0; i < m_focus.size(); ++i)
+		m_focus[i] = i;
+	m_direction.assign(m_active.size(), 1);
+}
+
 //-----------------------------------------------------------------------------
 //-----------------------------------------------------------------------------
 //-----------------------------------------------------------------------------
 
 //-----------------------------------------------------------------------------
-Compositions::Compositions(int sum) : m_num(2, sum-1) {
+static int countTrailingZeros(std::uint64_t x) {
+#if defined(_MSC_VER)
+	unsigned long index;
+	_BitScanForward64(&index, x);
+	return index;
+#else
+	return __builtin_ctzll(x);
+#endif
+}
+
+//-----------------------------------------------------------------------------
+Compositions::Compositions(int sum) : m_sum(sum), m_end(false), m_table(nullptr), m_partsCount(0), m_offset(0) {
+	if (sum < 1 || sum > 64)
+		throw std::exception();
+
+	// Первой идет композиция из одних единиц, то есть разрезы между всеми элементами
+	m_splits = (sum == 1) ? 0 : (~std::uint64_t(0) >> (65 - sum));
+	if (m_sum <= COMPOSITIONS_TABLE_SUM) {
+		m_table = &getTableComposition(m_sum, m_splits);
+		m_partsCount = m_table->count;
+	} else {
+		m_partsCount = m_sum;
+		m_offset = 64 - m_sum;
+		for (int i = m_offset; i < 64; ++i)
+			m_buffer[i] = 1;
+	}
 }
 
 //-----------------------------------------------------------------------------
 Compositions& Compositions::operator++(int) {
-	m_num++;
+	if (m_splits == 0) {
+		m_end = true;
+		return *this;
+	}
+
+	int lowest = countTrailingZeros(m_splits);
+	m_splits--;
+	if (m_table != nullptr) {
+		m_table = &getTableComposition(m_sum, m_splits);
+		m_partsCount = m_table->count;
+		return *this;
+	}
+
+	// Младший разрез пропал, а все биты под ним стали разрезами: первая часть из lowest + 1 элементов превращается в lowest единиц, а её последний элемент уходит во вторую часть
+	int first = m_offset;
+	m_buffer[first + 1]++;
+	m_offset = first + 1 - lowest;
+	for (int i = m_offset; i <= first; ++i)
+		m_buffer[i] = 1;
+	m_partsCount += lowest - 1;
 	return *this;
 }
 
 //-----------------------------------------------------------------------------
 bool Compositions::isEnd(void) const {
-	return m_num.isEnd();
+	return m_end;
 }
 
 //-----------------------------------------------------------------------------
 std::vector<int> Compositions::get(void) const {
-	std::vector<int> composition;
-	auto mas = m_num.get();
-	bool isAllZero = true;
-	for (int i = 0; i < mas.size(); ++i) {
-		if (mas[i] == 0) {
-			composition.push_back(1);
-		} else {
-			isAllZero &= false;
-			int count = 0;
-			while (i < mas.size() && mas[i] == 1) {
-				count++;
-				i++;
-			}
-			composition.push_back(count+1);
-		}
-	}
+	return std::vector<int>(getParts(), getParts() + m_partsCount);
+}
+
+//-----------------------------------------------------------------------------
+std::uint64_t Compositions::getSplits(void) const {
+	return m_splits;
+}
 
-	if (mas.back() != 1)
-		composition.push_back(1);
+//-----------------------------------------------------------------------------
+int Compositions::getPartsCount(void) const {
+	return m_partsCount;
+}
+
+//-----------------------------------------------------------------------------
+const unsigned char* Compositions::getParts(void) const {
+	return (m_table != nullptr) ? m_table->parts : m_buffer + m_offset;
+}
 
-	return composition;
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+
+//-----------------------------------------------------------------------------
+int getCompositionParts(int sum, std::uint64_t splits, unsigned char* parts) {
+	// Длина каждой части — это расстояние между соседними установленными битами
+	int count = 0;
+	int last = -1;
+	while (splits != 0) {
+		int current = countTrailingZeros(splits);
+		parts[count++] = current - last;
+		last = current;
+		splits &= splits - 1;
+	}
+	parts[count++] = sum - 1 - last;
+	return count;
 }
 
 };
\ No newline at end of file
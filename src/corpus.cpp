@@ -0,0 +1,238 @@
+﻿#include <algorithm>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <exception>
+#include <cwctype>
+#include <limits>
+
+#include <kbd/corpus.h>
+#include <kbd/lattice.h>
+
+namespace kbd
+{
+
+//-----------------------------------------------------------------------------
+std::vector<int> splitToChunks(const Layout& layout, const std::wstring& text, int maxOneHandSize, int chunkSize) {
+	std::vector<int> result;
+	int size = text.size();
+	if (size != 0)
+		result.push_back(0);
+
+	// Идём по частям так же, как typeText, и режем на первой границе части после chunkSize символов, перед которой пробельный символ, а после — нет
+	KeyLattice lattice;
+	std::wstring_view view = text;
+	int begin = 0;
+	int pos = 0;
+	while (pos < size) {
+		int symbolsCount;
+		buildFirstPartLattice(layout, view.substr(pos), maxOneHandSize, symbolsCount, lattice);
+		pos += symbolsCount;
+		if (pos < size && pos - begin >= chunkSize && std::iswspace(text[pos - 1]) && !std::iswspace(text[pos])) {
+			result.push_back(pos);
+			begin = pos;
+		}
+	}
+	result.push_back(size);
+	return result;
+}
+
+//-----------------------------------------------------------------------------
+CorpusTyping typeCorpus(const TyperFactory& makeTyper, const std::wstring& text, int maxOneHandSize, int defaultLayer, int chunkSize, int threadsCount) {
+	std::unique_ptr<Typer> firstTyper = makeTyper();
+	const Layout& layout = firstTyper->getLayout();
+	std::vector<int> chunks = splitToChunks(layout, text, maxOneHandSize, chunkSize);
+	int chunksCount = chunks.size() - 1;
+
+	if (threadsCount <= 0)
+		threadsCount = std::max<int>(std::thread::hardware_concurrency(), 1);
+	threadsCount = std::max(std::min(threadsCount, chunksCount), 1);
+
+	// Кусок набирается новым наборщиком, чтобы результат не зависел от того, какие куски тот же поток набирал раньше
+	const PhysicalState defaultState(defaultLayer);
+	std::vector<TextTyping> results(chunksCount);
+	std::vector<PhysicalState> ends(chunksCount, defaultState); // Состояние после каждого куска
+	auto typeChunk = [&] (int i, PhysicalState state, std::wstring& chunk) {
+		std::unique_ptr<Typer> typer = makeTyper();
+		chunk.assign(text, chunks[i], chunks[i + 1] - chunks[i]);
+		results[i] = typeText(*typer, chunk, maxOneHandSize, state);
+		results[i].accords.clear();
+		results[i].accords.shrink_to_fit();
+		ends[i] = state;
+	};
+
+	// Каждый поток берёт следующий ненабранный кусок и пишет результат в его ячейку
+	std::atomic<int> next(0);
+	std::exception_ptr error;
+	std::mutex errorMutex;
+	auto work = [&] () {
+		try {
+			std::wstring chunk;
+			for (int i = next++; i < chunksCount; i = next++)
+				typeChunk(i, defaultState, chunk);
+		} catch (...) {
+			std::lock_guard<std::mutex> lock(errorMutex);
+			if (!error)
+				error = std::current_exception();
+			next = chunksCount;
+		}
+	};
+
+	std::vector<std::thread> threads;
+	for (int i = 1; i < threadsCount; ++i)
+		threads.emplace_back(work);
+	work();
+	for (auto& i : threads)
+		i.join();
+	if (error)
+		std::rethrow_exception(error);
+
+	// Проходим куски по порядку: кусок, перед которым состояние не начальное, набираем заново из настоящего состояния. Складываем строго по порядку кусков.
+	CorpusTyping result = {0, 0, chunksCount, 0, 0};
+	PhysicalState state = defaultState;
+	std::wstring chunk;
+	for (int i = 0; i < chunksCount; ++i) {
+		if (state != defaultState) {
+			typeChunk(i, state, chunk);
+			result.retypedChunksCount++;
+		}
+
+		result.time += results[i].time;
+		result.typedSize += results[i].typedSize;
+		if (results[i].typedSize != chunks[i + 1] - chunks[i]) {
+			result.failedChunksCount++;
+			state = defaultState;
+		} else
+			state = ends[i];
+	}
+	return result;
+}
+
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+
+//-----------------------------------------------------------------------------
+double decomposeWord(const Layout& layout, std::wstring_view word, const PhysicalState& state, const AccordCost& cost, Accords& accords) {
+	double result = std::numeric_limits<double>::infinity();
+	accords.clear();
+
+	KeyLattice lattice(layout, word);
+	PhysicalState current = state;
+	KeyPoses keyPoses;
+	SearchStats stats;
+	for (KeyVariants keys(lattice); !keys.isEnd(); keys++) {
+		for (const auto& taps : decomposeToTaps(layout, keys.get(), current)) {
+			keyPoses.clear();
+			for (const auto& i : taps)
+				if (i.press != PRESS_UP)
+					keyPoses.push_back(i.key);
+
+			double variantCost;
+			Accords variant = decomposeToAccords(layout, keyPoses, cost, variantCost, stats);
+			if (variantCost < result) {
+				result = variantCost;
+				accords.swap(variant);
+			}
+		}
+	}
+
+	return result;
+}
+
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+
+//-----------------------------------------------------------------------------
+bool WordsCache::WordKey::operator==(const WordKey& other) const {
+	return fingerprint == other.fingerprint && state == other.state && word == other.word;
+}
+
+//-----------------------------------------------------------------------------
+std::size_t WordsCache::WordKeyHash::operator()(const WordKey& key) const {
+	std::size_t result = std::hash<std::wstring>()(key.word);
+	result ^= key.state.getHash() + 0x9e3779b97f4a7c15ull + (result << 6) + (result >> 2);
+	result ^= key.fingerprint + 0x9e3779b97f4a7c15ull + (result << 6) + (result >> 2);
+	return result;
+}
+
+//-----------------------------------------------------------------------------
+WordsCache::WordsCache(const AccordCost& cost, int capacity) : m_cost(cost), m_capacity(std::max(capacity, 1)), m_hand(0), m_hits(0), m_misses(0) {
+}
+
+//-----------------------------------------------------------------------------
+WordPlan WordsCache::get(const Layout& layout, std::wstring_view word, const PhysicalState& state) {
+	WordKey key = {layout.getFingerprint(), state, std::wstring(word)};
+
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		auto found = m_index.find(key);
+		if (found != m_index.end()) {
+			m_hits++;
+			Entry& entry = m_entries[found->second];
+			entry.referenced = true;
+			return entry.plan;
+		}
+		m_misses++;
+	}
+
+	// Считаем без блокировки, чтобы другие потоки в это время могли читать кэш. Если то же слово одновременно считают два потока, то запомнится первый результат.
+	WordPlan plan;
+	plan.cost = decomposeWord(layout, word, state, m_cost, plan.accords);
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if (m_index.find(key) != m_index.end())
+		return plan;
+
+	if (m_entries.size() < m_capacity) {
+		m_index[key] = m_entries.size();
+		m_entries.push_back({key, plan, false});
+		return plan;
+	}
+
+	// Ищем запись, к которой не обращались с прошлого прохода стрелки, и заменяем её
+	while (m_entries[m_hand].referenced) {
+		m_entries[m_hand].referenced = false;
+		m_hand = (m_hand + 1) % m_entries.size();
+	}
+	Entry& victim = m_entries[m_hand];
+	m_index.erase(victim.key);
+	m_index[key] = m_hand;
+	victim = {key, plan, false};
+	m_hand = (m_hand + 1) % m_entries.size();
+	return plan;
+}
+
+//-----------------------------------------------------------------------------
+int WordsCache::size(void) const {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_entries.size();
+}
+
+//-----------------------------------------------------------------------------
+int WordsCache::getCapacity(void) const {
+	return m_capacity;
+}
+
+//-----------------------------------------------------------------------------
+long long WordsCache::getHitsCount(void) const {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_hits;
+}
+
+//-----------------------------------------------------------------------------
+long long WordsCache::getMissesCount(void) const {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_misses;
+}
+
+//-----------------------------------------------------------------------------
+void WordsCache::clear(void) {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_entries.clear();
+	m_index.clear();
+	m_hand = 0;
+}
+
+};
@@ -1,13 +1,21 @@
 ﻿#include <vector>
 #include <algorithm>
-#include <set>
+#include <queue>
+#include <limits>
+#include <type_traits>
+#include <cstring>
 
 #include <kbd/keyboard.h>
 #include <kbd/combinatorics.h>
+#include <kbd/lattice.h>
 
 namespace kbd
 {
 
+//-----------------------------------------------------------------------------
+// Размер плотной таблицы клавиш в Layout, см. Layout::getDenseSlot
+const int DENSE_KEYS_SIZE = 0x0500 + 0x0070;
+
 //-----------------------------------------------------------------------------
 // Ребро ориентированного графа
 struct Edge {
@@ -19,37 +27,76 @@ struct Edge {
 
 typedef std::vector<Edge> Edges;
 
+// Рёбра, выходящие из одной вершины. Указывают внутрь графа, поэтому граф должен жить дольше них.
+struct AdjacentEdges
+{
+	const Edge* first;
+	const Edge* last;
+
+	const Edge* begin(void) const { return first; }
+	const Edge* end(void) const { return last; }
+	int size(void) const { return last - first; }
+};
+
 //-----------------------------------------------------------------------------
-// Класс ориентированного графа
+// Класс ориентированного графа. Строится один раз: рёбра сортируются по начальной вершине и хранятся подряд (CSR), поэтому соседи вершины получаются за O(1) без копирования.
 class DirectedGraph
 {
 public:
-	void addEdge(Edge ed);
+	DirectedGraph();
+	DirectedGraph(int vertexesCount, const Edges& edges);
+
+	int getVertexesCount(void) const;
 	int getEdgeCount(void) const;
-	Edges getAdjacent(int i) const;
-	Edge getEdge(int i) const;
-	void deleteEdge(int i);
-	std::vector<int> getVertixes(void) const;
+	AdjacentEdges getAdjacent(int i) const;
+	const Edge& getEdge(int i) const;
 private:
-	std::vector<Edge> m_edges;
+	std::vector<int> 	m_edgeBegin; // Рёбра вершины i лежат в m_edges[m_edgeBegin[i]..m_edgeBegin[i+1])
+	Edges 				m_edges;
 };
 
 //-----------------------------------------------------------------------------
-// Обходит граф, при этом инициализирует map, который отвечает за все возможные методы перехода с одного слоя на другой слой
-void travelGraph_InitMap(
+// Обходит граф в ширину из каждого слоя и для каждой пары слоёв находит до maxVariants самых коротких путей без повторения слоёв. Результат точный: это первые maxVariants путей в том порядке, в котором их дал бы обход всех путей. layerKeys[a * n + b], где n — число вершин графа, — переходы со слоя a на слой b в порядке возрастания длины.
+void findLayerKeys(
 	const DirectedGraph& graph,
-	std::map<std::pair<int, int>, std::vector<KeyPoses>>& layerMap,
-	int firstLayer);
+	int maxVariants,
+	std::vector<std::vector<KeyPoses>>& layerKeys
+);
 
-// Рекурсивная часть верхней функции
-void travelGraph_InitMap_r(
-	const DirectedGraph& graph,
-	std::map<std::pair<int, int>, std::vector<KeyPoses>>& layerMap,
-	KeyPoses path,
-	std::set<int> attendedLayers,
-	int firstLayer,
-	int currentLayer,
-	int currentKey
+//-----------------------------------------------------------------------------
+// Разбивает нажатия клавиш на части, каждая из которых набирается одной рукой
+std::vector<std::pair<KeyPoses, Hand>> splitByHands(
+	const Keyboard& keyboard,
+	const KeyPoses& keyPoses
+);
+
+// Проверяет, что все клавиши аккорда keyPoses[pos..pos+size) нажимаются разными пальцами
+bool isAccordOnDifferentFingers(
+	const Keyboard& keyboard,
+	const KeyPoses& keyPoses,
+	int pos,
+	int size
+);
+
+// Перебирает все композиции числа клавиш и возвращает маски разрезов тех, что являются допустимым разложением на аккорды
+std::vector<std::uint64_t> findOneHandAccordsSplits(
+	const Keyboard& keyboard,
+	const KeyPoses& keyPoses
+);
+
+// Рекурсивная часть поиска самого дешевого разложения одной руки на аккорды методом ветвей и границ
+void decomposeOneHandAccords_r(
+	const Keyboard& keyboard,
+	const KeyPoses& keyPoses,
+	const std::vector<std::vector<double>>& accordCost,
+	const std::vector<double>& lowerBound,
+	int pos,
+	int lastSize,
+	Accords& current,
+	double currentCost,
+	Accords& best,
+	double& bestCost,
+	SearchStats& stats
 );
 
 //=============================================================================
@@ -57,96 +104,114 @@ void travelGraph_InitMap_r(
 //=============================================================================
 
 //-----------------------------------------------------------------------------
-void DirectedGraph::addEdge(Edge ed) {
-	m_edges.push_back(ed);
+DirectedGraph::DirectedGraph() : m_edgeBegin(1, 0) {
 }
 
 //-----------------------------------------------------------------------------
-int DirectedGraph::getEdgeCount(void) const {
-	return m_edges.size();
-}
-
-//-----------------------------------------------------------------------------
-Edges DirectedGraph::getAdjacent(int k) const {
-	Edges result;
-	for (const auto& ed : m_edges) {
-		if (ed.a == k)
-			result.push_back(ed);
+DirectedGraph::DirectedGraph(int vertexesCount, const Edges& edges) : m_edgeBegin(vertexesCount + 1, 0), m_edges(edges.size()) {
+	// Сортировка подсчётом по начальной вершине, порядок рёбер одной вершины сохраняется
+	for (const auto& ed : edges) {
+		if (ed.a < 0 || ed.a >= vertexesCount || ed.b < 0 || ed.b >= vertexesCount)
+			throw std::exception();
+		m_edgeBegin[ed.a + 1]++;
 	}
+	for (int i = 0; i < vertexesCount; ++i)
+		m_edgeBegin[i + 1] += m_edgeBegin[i];
 
-	return result;
+	std::vector<int> next(m_edgeBegin.begin(), m_edgeBegin.end() - 1);
+	for (const auto& ed : edges)
+		m_edges[next[ed.a]++] = ed;
 }
 
 //-----------------------------------------------------------------------------
-Edge DirectedGraph::getEdge(int i) const {
-	return m_edges[i];
+int DirectedGraph::getVertexesCount(void) const {
+	return m_edgeBegin.size() - 1;
 }
 
 //-----------------------------------------------------------------------------
-void DirectedGraph::deleteEdge(int i) {
-	m_edges.erase(m_edges.begin() + i);
+int DirectedGraph::getEdgeCount(void) const {
+	return m_edges.size();
 }
 
 //-----------------------------------------------------------------------------
-std::vector<int> DirectedGraph::getVertixes(void) const {
-	std::vector<int> result;
-	for (const auto& ed : m_edges) {
-		result.push_back(ed.a);
-		result.push_back(ed.b);
-	}
-	std::sort(result.begin(), result.end());
-	result.erase(std::unique(result.begin(), result.end()), result.end());
-	return result;
+AdjacentEdges DirectedGraph::getAdjacent(int k) const {
+	const Edge* edges = m_edges.data();
+	return {edges + m_edgeBegin[k], edges + m_edgeBegin[k + 1]};
 }
 
 //-----------------------------------------------------------------------------
+const Edge& DirectedGraph::getEdge(int i) const {
+	return m_edges[i];
+}
+
 //-----------------------------------------------------------------------------
 //-----------------------------------------------------------------------------
-
 //-----------------------------------------------------------------------------
-void travelGraph_InitMap(
-	const DirectedGraph& graph,
-	std::map<std::pair<int, int>, std::vector<KeyPoses>>& layerMap,
-	int firstLayer) {
-	travelGraph_InitMap_r(graph, layerMap, {}, {}, firstLayer, firstLayer, 0);
-}
 
 //-----------------------------------------------------------------------------
-void travelGraph_InitMap_r(
+void findLayerKeys(
 	const DirectedGraph& graph,
-	std::map<std::pair<int, int>, std::vector<KeyPoses>>& layerMap,
-	KeyPoses path,
-	std::set<int> attendedLayers,
-	int firstLayer,
-	int currentLayer,
-	int currentKey
+	int maxVariants,
+	std::vector<std::vector<KeyPoses>>& layerKeys
 ) {
-	attendedLayers.insert(currentLayer);
-	if (currentLayer != firstLayer)
-		path.push_back(currentKey);
-	if (path.size() != 0) {
-		// Ищем дубликаты текущего пути. Если их нет, то добавляем
-		auto& paths = layerMap[{firstLayer, currentLayer}];
-
-		bool isAdd = true;
-		for (const auto& i : paths)
-			if (i.size() == path.size()) {
-				bool isEqual = true;
-				for (int j = 0; j < i.size(); ++j)
-					isEqual &= i[j] == path[j];
-				if (isEqual) {
-					isAdd = false;
-					break;
+	int layersCount = graph.getVertexesCount();
+	layerKeys.assign(layersCount * layersCount, {});
+
+	// Путь по слоям, visited — маска уже пройденных слоёв
+	struct LayerPath
+	{
+		int 			layer;
+		std::uint64_t 	visited;
+		KeyPoses 		keys;
+	};
+
+	// Маска слоёв, куда можно попасть из каждого слоя хотя бы одним нажатием, без учёта уже пройденных слоёв
+	std::vector<std::uint64_t> reachable(layersCount, 0);
+	std::vector<int> stack;
+	for (int from = 0; from < layersCount; ++from) {
+		stack.assign(1, from);
+		while (!stack.empty()) {
+			int layer = stack.back();
+			stack.pop_back();
+			for (const auto& ed : graph.getAdjacent(layer)) {
+				std::uint64_t bit = std::uint64_t(1) << ed.b;
+				if (!(reachable[from] & bit)) {
+					reachable[from] |= bit;
+					stack.push_back(ed.b);
 				}
 			}
-		if (isAdd)
-			paths.push_back(path);
+		}
 	}
 
-	auto adj = graph.getAdjacent(currentLayer);
-	for (auto& i : adj) {
-		if (attendedLayers.find(i.b) == attendedLayers.end())
-			travelGraph_InitMap_r(graph, layerMap, path, attendedLayers, firstLayer, i.b, i.key);
+	// Пути достаются из очереди в порядке возрастания длины, поэтому первые найденные переходы самые короткие. Путь продолжается, только пока из его слоя можно попасть в слой, для которого найдено меньше maxVariants переходов: остальные пути в заполненные слои никогда не попадут, поэтому их отбрасывание не меняет результат. Как только заполнены все достижимые слои, очередь кончается; дольше перебор идёт, только если до незаполненного слоя мало путей без повторения слоёв, а к его соседям — много.
+	std::vector<LayerPath> queue;
+	for (int first = 0; first < layersCount; ++first) {
+		queue.clear();
+		queue.push_back({first, std::uint64_t(1) << first, {}});
+		std::uint64_t full = std::uint64_t(1) << first; // Слои, для которых больше ничего не нужно
+
+		for (int head = 0; head < queue.size(); ++head) {
+			LayerPath path = std::move(queue[head]);
+			if (!(full & (std::uint64_t(1) << path.layer))) {
+				std::vector<KeyPoses>& found = layerKeys[first * layersCount + path.layer];
+				found.push_back(path.keys);
+				if (found.size() >= maxVariants)
+					full |= std::uint64_t(1) << path.layer;
+			}
+
+			if (!(reachable[path.layer] & ~full))
+				continue;
+
+			for (const auto& ed : graph.getAdjacent(path.layer)) {
+				std::uint64_t bit = std::uint64_t(1) << ed.b;
+				if ((path.visited & bit) || !((bit | reachable[ed.b]) & ~full))
+					continue;
+
+				KeyPoses keys = path.keys;
+				keys.push_back(ed.key);
+				queue.push_back({ed.b, path.visited | bit, std::move(keys)});
+			}
+		}
 	}
 }
 
@@ -155,14 +220,44 @@ void travelGraph_InitMap_r(
 //-----------------------------------------------------------------------------
 
 //-----------------------------------------------------------------------------
-Keyboard::Keyboard() {
+int getFingerId(Hand hand, Finger finger) {
+	if (hand == HAND_ANY || finger == FINGER_ANY)
+		return NO_FINGER_ID;
+	return (hand-1)*5 + finger-1;
+}
+
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+
+//-----------------------------------------------------------------------------
+Keyboard::Keyboard() : m_accordsCache(std::make_shared<AccordsCache>()) {
+	initKeysIndex();
 }
 
 //-----------------------------------------------------------------------------
 Keyboard::Keyboard(std::string name, 
-				   const std::vector<KeyboardKey>& keys) : m_name(name), m_keys(keys) {
+				   const std::vector<KeyboardKey>& keys) : m_name(name), m_keys(keys), m_accordsCache(std::make_shared<AccordsCache>()) {
+	initAttributes();
+	initKeysIndex();
 }	
 
+//-----------------------------------------------------------------------------
+void Keyboard::initAttributes(void) {
+	m_hands.resize(m_keys.size());
+	m_fingers.resize(m_keys.size());
+	m_rows.resize(m_keys.size());
+	m_columns.resize(m_keys.size());
+	m_fingerIds.resize(m_keys.size());
+	for (int i = 0; i < m_keys.size(); ++i) {
+		m_hands[i] = m_keys[i].hand;
+		m_fingers[i] = m_keys[i].finger;
+		m_rows[i] = m_keys[i].row;
+		m_columns[i] = m_keys[i].column;
+		m_fingerIds[i] = getFingerId(m_keys[i].hand, m_keys[i].finger);
+	}
+}
+
 //-----------------------------------------------------------------------------
 int Keyboard::size(void) const {
 	return m_keys.size();
@@ -175,22 +270,22 @@ std::string Keyboard::getName(void) const {
 
 //-----------------------------------------------------------------------------
 Hand Keyboard::getHand(KeyPos key) const {
-	return m_keys[key].hand;
+	return Hand(m_hands[key]);
 }
 
 //-----------------------------------------------------------------------------
 Finger Keyboard::getFinger(KeyPos key) const {
-	return m_keys[key].finger;
+	return Finger(m_fingers[key]);
 }
 
 //-----------------------------------------------------------------------------
 Row Keyboard::getRow(KeyPos key) const {
-	return m_keys[key].row;
+	return Row(m_rows[key]);
 }
 
 //-----------------------------------------------------------------------------
 Column Keyboard::getColumn(KeyPos key) const {
-	return m_keys[key].column;
+	return Column(m_columns[key]);
 }
 
 //-----------------------------------------------------------------------------
@@ -209,22 +304,11 @@ double Keyboard::getAngle(KeyPos key) const {
 }
 
 //-----------------------------------------------------------------------------
-std::vector<KeyPos> Keyboard::getKeys(Hand hand,
-									  Finger finger,
-									  Row row,
-									  Column column) const {
-	std::vector<KeyPos> result;
-	for (int i = 0; i < m_keys.size(); ++i) {
-		auto& key = m_keys[i];
-
-		bool isHand = (hand == HAND_ANY) || (hand == key.hand);
-		bool isFinger = (finger == FINGER_ANY) || (finger == key.finger);
-		bool isRow = (row == ROW_ANY) || (row == key.row);
-		bool isColumn = (column == COLUMN_ANY) || (column == key.column);
-
-		if (isHand && isFinger && isRow && isColumn)
-			result.push_back(i);
-	}
+const KeyPoses& Keyboard::getKeys(Hand hand,
+								  Finger finger,
+								  Row row,
+								  Column column) const {
+	const KeyPoses& result = m_keysIndex[getKeysIndex(hand, finger, row, column)];
 
 	// Если задано всё, то число клавиш обязано быть 0 или 1
 	if (hand != HAND_ANY && 
@@ -233,6 +317,29 @@ std::vector<KeyPos> Keyboard::getKeys(Hand hand,
 		column != COLUMN_ANY && 
 		result.size() > 1)
 		throw std::exception();
+
+	return result;
+}
+
+//-----------------------------------------------------------------------------
+int Keyboard::getKeysIndex(int hand, int finger, int row, int column) {
+	return ((hand*(FINGER_THUMB+1) + finger)*(ROW_HIGHEST+1) + row)*(COLUMN_2RIGHT+1) + column;
+}
+
+//-----------------------------------------------------------------------------
+void Keyboard::initKeysIndex(void) {
+	m_keysIndex.assign((HAND_RIGHT+1)*(FINGER_THUMB+1)*(ROW_HIGHEST+1)*(COLUMN_2RIGHT+1), {});
+
+	// Каждая клавиша подходит ровно под 16 запросов: каждое свойство либо равно свойству клавиши, либо любое
+	for (int i = 0; i < m_keys.size(); ++i) {
+		for (int mask = 0; mask < 16; ++mask) {
+			int hand = (mask & 1) ? int(HAND_ANY) : int(m_hands[i]);
+			int finger = (mask & 2) ? int(FINGER_ANY) : int(m_fingers[i]);
+			int row = (mask & 4) ? int(ROW_ANY) : int(m_rows[i]);
+			int column = (mask & 8) ? int(COLUMN_ANY) : int(m_columns[i]);
+			m_keysIndex[getKeysIndex(hand, finger, row, column)].push_back(i);
+		}
+	}
 }
 
 //-----------------------------------------------------------------------------
@@ -241,67 +348,284 @@ std::vector<Keyboard::KeyboardKey> Keyboard::getKeyboardInnerFormat(void) const
 }
 
 //-----------------------------------------------------------------------------
+const std::uint8_t* Keyboard::getHands(void) const {
+	return m_hands.data();
+}
+
+//-----------------------------------------------------------------------------
+const std::uint8_t* Keyboard::getFingers(void) const {
+	return m_fingers.data();
+}
+
+//-----------------------------------------------------------------------------
+const std::uint8_t* Keyboard::getRows(void) const {
+	return m_rows.data();
+}
+
 //-----------------------------------------------------------------------------
+const std::uint8_t* Keyboard::getColumns(void) const {
+	return m_columns.data();
+}
+
 //-----------------------------------------------------------------------------
+const std::uint16_t* Keyboard::getFingerIds(void) const {
+	return m_fingerIds.data();
+}
 
 //-----------------------------------------------------------------------------
-PhysicalState::PhysicalState(int defaultLayer) : isOneTap(false), oneTapLayer(0) {
-	layerStack.push_back({-1, defaultLayer});
+const std::vector<std::uint64_t>& Keyboard::getOneHandAccordsSplits(const KeyPoses& keyPoses) const {
+	if (keyPoses.size() > MAX_CACHED_ACCORDS_SIZE)
+		throw std::exception();
+
+	// Ключ — номера пальцев всех клавиш по 4 бита, перед ними единица, чтобы различались последовательности разной длины. Номера те же, что проверяет findOneHandAccordsSplits: одинаковые пальцы разных рук различаются, а NO_FINGER_ID становится 15.
+	std::uint64_t signature = 1;
+	for (const auto& i : keyPoses)
+		signature = (signature << 4) | (m_fingerIds[i] & 0xF);
+
+	std::lock_guard<std::mutex> lock(m_accordsCache->mutex);
+	auto found = m_accordsCache->splits.find(signature);
+	if (found != m_accordsCache->splits.end())
+		return found->second;
+	return m_accordsCache->splits[signature] = findOneHandAccordsSplits(*this, keyPoses);
+}
+
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+
+//-----------------------------------------------------------------------------
+static_assert(std::is_trivially_copyable<PhysicalState>::value, "PhysicalState must be trivially copyable");
+
+//-----------------------------------------------------------------------------
+PhysicalState::PhysicalState(int defaultLayer) : m_busyMask(0), m_busyKeys(), m_layerStack(), m_layerStackSize(1), m_isOneTap(false), m_oneTapLayer(0) {
+	m_layerStack[0] = {NO_FINGER_ID, std::int16_t(defaultLayer)};
 }
 
 //-----------------------------------------------------------------------------
 void PhysicalState::addOneTap(int layer) {
-	isOneTap = true;
-	oneTapLayer = layer;
+	m_isOneTap = true;
+	m_oneTapLayer = layer;
 }
 
 //-----------------------------------------------------------------------------
 int PhysicalState::getCurrentLayer(void) const {
-	if (isOneTap) {
-		isOneTap = false;
-		return oneTapLayer;
+	if (m_isOneTap) {
+		m_isOneTap = false;
+		return m_oneTapLayer;
 	} else
-		return layerStack.back().second;
+		return m_layerStack[m_layerStackSize - 1].layer;
 }
 
 //-----------------------------------------------------------------------------
 std::optional<KeyPos> PhysicalState::isFingerBusy(Hand hand, Finger finger) const {
-	try {
-		return busyFingers.at({ hand, finger });
-	} catch (...) {
+	int fingerId = getFingerId(hand, finger);
+	if (fingerId == NO_FINGER_ID || !(m_busyMask & (1 << fingerId)))
 		return std::nullopt;
-	}
+	return m_busyKeys[fingerId];
 }
 
 //-----------------------------------------------------------------------------
 void PhysicalState::busyFinger(Hand hand, Finger finger, KeyPos key, int layer) {
-	if (hand == HAND_ANY || finger == FINGER_ANY)
+	int fingerId = getFingerId(hand, finger);
+	if (fingerId == NO_FINGER_ID || (m_busyMask & (1 << fingerId)))
 		throw std::exception();
-	busyFingers[{hand, finger}] = key;
-	FingerId fingerId = (hand-1)*5 + finger-1;
-	layerStack.push_back({fingerId, layer});
+	m_busyMask |= 1 << fingerId;
+	m_busyKeys[fingerId] = key;
+	m_layerStack[m_layerStackSize++] = {std::uint16_t(fingerId), std::int16_t(layer)};
 }
 
 //-----------------------------------------------------------------------------
 bool PhysicalState::unbusyFinger(Hand hand, Finger finger) {
-	FingerId fingerId = (hand-1)*5 + finger-1;
-	if (busyFingers[{hand, finger}] == std::nullopt)
-		throw std::exception();
-	busyFingers[{hand, finger}] = std::nullopt;
-	for (int j = 0; j < layerStack.size(); j++) {
-		if (layerStack[j].first == fingerId) {
-			layerStack.erase(layerStack.begin() + j);
-			break;
+	int fingerId = getFingerId(hand, finger);
+	if (fingerId == NO_FINGER_ID || !(m_busyMask & (1 << fingerId)))
+		return false;
+	m_busyMask &= ~(1 << fingerId);
+	m_busyKeys[fingerId] = 0;
+
+	// Сдвигаем стек, освободившееся место обнуляем, чтобы равные состояния были равны побайтово
+	int j = 1;
+	while (m_layerStack[j].fingerId != fingerId)
+		j++;
+	for (; j + 1 < m_layerStackSize; ++j)
+		m_layerStack[j] = m_layerStack[j + 1];
+	m_layerStack[--m_layerStackSize] = {0, 0};
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+std::uint16_t PhysicalState::getBusyMask(void) const {
+	return m_busyMask;
+}
+
+//-----------------------------------------------------------------------------
+bool PhysicalState::operator==(const PhysicalState& other) const {
+	if (m_busyMask != other.m_busyMask || m_layerStackSize != other.m_layerStackSize || m_isOneTap != other.m_isOneTap)
+		return false;
+	if (m_isOneTap && m_oneTapLayer != other.m_oneTapLayer)
+		return false;
+	for (int i = 0; i < FINGERS_COUNT; ++i)
+		if (m_busyKeys[i] != other.m_busyKeys[i])
+			return false;
+	for (int i = 0; i < m_layerStackSize; ++i)
+		if (m_layerStack[i].fingerId != other.m_layerStack[i].fingerId || m_layerStack[i].layer != other.m_layerStack[i].layer)
+			return false;
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+bool PhysicalState::operator!=(const PhysicalState& other) const {
+	return !(*this == other);
+}
+
+//-----------------------------------------------------------------------------
+std::size_t PhysicalState::getHash(void) const {
+	// FNV-1a по тем же полям, что сравниваются в operator==
+	std::uint64_t hash = 14695981039346656037ull;
+	auto add = [&hash] (std::uint64_t value) {
+		hash ^= value;
+		hash *= 1099511628211ull;
+	};
+
+	add(m_busyMask);
+	add(m_isOneTap ? m_oneTapLayer + 1 : 0);
+	for (int i = 0; i < FINGERS_COUNT; ++i)
+		if (m_busyMask & (1 << i))
+			add(m_busyKeys[i]);
+	for (int i = 0; i < m_layerStackSize; ++i)
+		add(std::uint64_t(m_layerStack[i].fingerId) << 16 | std::uint16_t(m_layerStack[i].layer));
+	return hash;
+}
+
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+
+//-----------------------------------------------------------------------------
+OutputsMatcher::OutputsMatcher() : m_edgeBegin(2, 0), m_fail(1, 0), m_nextMatch(1, -1), m_depth(1, 0), m_keys(1), m_maxMatchSize(0) {
+}
+
+//-----------------------------------------------------------------------------
+OutputsMatcher::OutputsMatcher(const std::vector<std::pair<std::wstring_view, Key>>& outputs) {
+	// Строим бор, пока рёбра хранятся в map, чтобы потом сразу выложить их отсортированными
+	std::vector<std::map<wchar_t, int>> trie(1);
+	m_depth.assign(1, 0);
+	m_keys.assign(1, {});
+	m_maxMatchSize = 0;
+	for (const auto& i : outputs) {
+		int state = 0;
+		for (const auto& letter : i.first) {
+			auto found = trie[state].find(letter);
+			if (found == trie[state].end()) {
+				trie[state][letter] = trie.size();
+				state = trie.size();
+				trie.emplace_back();
+				m_depth.push_back(0);
+				m_keys.emplace_back();
+			} else
+				state = found->second;
+		}
+		m_keys[state].push_back(i.second);
+	}
+
+	int size = trie.size();
+	m_edgeBegin.assign(size + 1, 0);
+	m_edgeLetters.clear();
+	m_edgeTargets.clear();
+	for (int i = 0; i < size; ++i) {
+		m_edgeBegin[i] = m_edgeLetters.size();
+		for (const auto& j : trie[i]) {
+			m_edgeLetters.push_back(j.first);
+			m_edgeTargets.push_back(j.second);
+		}
+	}
+	m_edgeBegin[size] = m_edgeLetters.size();
+
+	// Суффиксные ссылки считаются обходом в ширину, так как ссылка всегда ведет в вершину меньшей глубины
+	m_fail.assign(size, 0);
+	m_nextMatch.assign(size, -1);
+	std::vector<int> queue(1, 0);
+	for (int head = 0; head < queue.size(); ++head) {
+		int state = queue[head];
+		for (int i = m_edgeBegin[state]; i < m_edgeBegin[state + 1]; ++i) {
+			wchar_t letter = m_edgeLetters[i];
+			int child = m_edgeTargets[i];
+			m_depth[child] = m_depth[state] + 1;
+			m_maxMatchSize = std::max(m_maxMatchSize, m_depth[child]);
+
+			int fail = 0;
+			if (state != 0) {
+				fail = m_fail[state];
+				while (fail != 0 && getEdge(fail, letter) == -1)
+					fail = m_fail[fail];
+				int edge = getEdge(fail, letter);
+				if (edge != -1)
+					fail = edge;
+			}
+			m_fail[child] = fail;
+			m_nextMatch[child] = m_keys[fail].empty() ? m_nextMatch[fail] : fail;
+			queue.push_back(child);
 		}
 	}
 }
 
 //-----------------------------------------------------------------------------
+int OutputsMatcher::getStartState(void) const {
+	return 0;
+}
+
+//-----------------------------------------------------------------------------
+int OutputsMatcher::next(int state, wchar_t letter) const {
+	while (true) {
+		int edge = getEdge(state, letter);
+		if (edge != -1)
+			return edge;
+		if (state == 0)
+			return 0;
+		state = m_fail[state];
+	}
+}
+
+//-----------------------------------------------------------------------------
+int OutputsMatcher::getFirstMatch(int state) const {
+	return m_keys[state].empty() ? m_nextMatch[state] : state;
+}
+
+//-----------------------------------------------------------------------------
+int OutputsMatcher::getNextMatch(int match) const {
+	return m_nextMatch[match];
+}
+
+//-----------------------------------------------------------------------------
+int OutputsMatcher::getMatchSize(int match) const {
+	return m_depth[match];
+}
+
 //-----------------------------------------------------------------------------
+const Keys& OutputsMatcher::getMatchKeys(int match) const {
+	return m_keys[match];
+}
+
 //-----------------------------------------------------------------------------
+int OutputsMatcher::getMaxMatchSize(void) const {
+	return m_maxMatchSize;
+}
 
 //-----------------------------------------------------------------------------
-Layout::Layout() {
+int OutputsMatcher::getEdge(int state, wchar_t letter) const {
+	auto begin = m_edgeLetters.begin() + m_edgeBegin[state];
+	auto end = m_edgeLetters.begin() + m_edgeBegin[state + 1];
+	auto found = std::lower_bound(begin, end, letter);
+	if (found == end || *found != letter)
+		return -1;
+	return m_edgeTargets[found - m_edgeLetters.begin()];
+}
+
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+
+//-----------------------------------------------------------------------------
+Layout::Layout() : m_layersCount(0), m_fingerprint(0) {
 }
 
 //-----------------------------------------------------------------------------
@@ -310,58 +634,191 @@ Layout::Layout(const Keyboard& keyboard,
 	//-------------------------------------------------------------------------
 	// Заполняем массив слоёв с клавишами
 
-	// Подсчет числа слоёв
+	// Подсчет числа слоёв, в том числе тех, что только включаются клавишами
 	int layers = 0;
-	for (const auto& i : symbols)
+	for (const auto& i : symbols) {
 		if (i.key.layer > layers)
 			layers = i.key.layer;
+		if (!i.symbols.empty()) {
+			auto nextLayer = getLayer(i.symbols.back());
+			if (nextLayer && *nextLayer > layers)
+				layers = *nextLayer;
+		}
+	}
+	m_layersCount = layers+1;
+	if (m_layersCount > MAX_LAYERS_COUNT)
+		throw std::exception();
 
-	// Инициализируем массив заданным числом слоёв
-	m_layerMas = std::vector<std::vector<std::wstring>>(layers+1, std::vector<std::wstring>(keyboard.size()));
+	// Складываем символы всех клавиш в одну строку, переключение слоя в конце разбираем сразу
+	m_symbolsIndex.assign(m_layersCount * size(), {0, 0, -1});
+	std::unordered_map<std::wstring, std::uint32_t> interned;
+	for (const auto& i : symbols) {
+		auto found = interned.find(i.symbols);
+		std::uint32_t offset;
+		if (found != interned.end())
+			offset = found->second;
+		else {
+			offset = m_symbolsBuffer.size();
+			m_symbolsBuffer += i.symbols;
+			interned[i.symbols] = offset;
+		}
+
+		SymbolsRange& range = m_symbolsIndex[i.key.layer * size() + i.key.key];
+		range.offset = offset;
+		range.size = i.symbols.size();
+		range.nextLayer = -1;
+		if (!i.symbols.empty()) {
+			auto nextLayer = getLayer(i.symbols.back());
+			if (nextLayer) {
+				range.size--;
+				range.nextLayer = *nextLayer;
+			}
+		}
+	}
 
-	// Заполняем массив слоёв клавишами
-	for (const auto& i : symbols)
-		m_layerMas[i.key.layer][i.key.key] = i.symbols;
- 
  	//-------------------------------------------------------------------------
-	// Инициализируем map для клавиш
-	for (const auto& i : symbols)
-		m_keyMap[i.symbols[0]].push_back(i.key);
+	// Инициализируем таблицу клавиш по первому символу
+	m_denseKeyIndex.assign(DENSE_KEYS_SIZE, 0);
+	for (const auto& i : symbols) {
+		wchar_t letter = i.symbols[0];
+		int slot = getDenseSlot(letter);
+		std::uint32_t& index = (slot != -1) ? m_denseKeyIndex[slot] : m_sparseKeyIndex[letter];
+		if (index == 0) {
+			m_keyLists.push_back({});
+			index = m_keyLists.size();
+		}
+		m_keyLists[index - 1].push_back(i.key);
+	}
 
 	//-------------------------------------------------------------------------
-	// Инициализируем map для слоёв
+	// Строим автомат по выводу всех клавиш
+	std::vector<std::pair<std::wstring_view, Key>> outputs;
+	for (const auto& i : symbols) {
+		auto output = getOutput(i.key);
+		if (!output.empty())
+			outputs.push_back({output, i.key});
+	}
+	m_matcher = OutputsMatcher(outputs);
+
+	//-------------------------------------------------------------------------
+	// Инициализируем таблицу переходов между слоями
 
 	// Создаём граф по слоям
-	DirectedGraph graph;
+	Edges edges;
 	for (const auto& i : symbols) {
-		auto layer = getLayer(i.symbols[0]);
-		if (i.symbols.size() == 1 && layer)
-			graph.addEdge({i.key.layer, *layer, i.key.key});
+		if (isLayerKey(i.key))
+			edges.push_back({i.key.layer, getNextLayer(i.key), i.key.key});
 	}
+	DirectedGraph graph(m_layersCount, edges);
+
+	findLayerKeys(graph, MAX_LAYER_KEYS_VARIANTS, m_layerKeys);
+
+	//-------------------------------------------------------------------------
+	// Считаем хэш раскладки FNV-1a по всем свойствам клавиш и их символам
+	m_fingerprint = 14695981039346656037ull;
+	auto add = [this] (std::uint64_t value) {
+		m_fingerprint ^= value;
+		m_fingerprint *= 1099511628211ull;
+	};
+	auto addDouble = [&add] (double value) {
+		std::uint64_t bits;
+		std::memcpy(&bits, &value, sizeof(bits));
+		add(bits);
+	};
 
-	// Перебираем все вершины и из них находим все пути до других вершин
-	auto vertixes = graph.getVertixes();
-	for (const auto& i : vertixes)
-		travelGraph_InitMap(graph, m_layerMap, i);
+	for (const auto& i : getKeyboardInnerFormat()) {
+		addDouble(i.x); addDouble(i.y);
+		addDouble(i.xsize); addDouble(i.ysize);
+		addDouble(i.angle);
+		add(i.hand); add(i.finger); add(i.row); add(i.column);
+	}
+	add(m_layersCount);
+	for (int layer = 0; layer < m_layersCount; ++layer) {
+		for (int key = 0; key < size(); ++key) {
+			for (const auto& c : getSymbols({layer, key}))
+				add(c);
+			add(0x10000 + getNextLayer({layer, key}));
+		}
+	}
+}
+
+//-----------------------------------------------------------------------------
+std::wstring_view Layout::getSymbols(Key key) const {
+	const SymbolsRange& range = getSymbolsRange(key);
+	return std::wstring_view(m_symbolsBuffer).substr(range.offset, range.size + (range.nextLayer != -1));
+}
+
+//-----------------------------------------------------------------------------
+std::wstring_view Layout::getOutput(Key key) const {
+	const SymbolsRange& range = getSymbolsRange(key);
+	return std::wstring_view(m_symbolsBuffer).substr(range.offset, range.size);
 }
 
 //-----------------------------------------------------------------------------
-const std::wstring& Layout::getSymbols(Key key) const {
-	return m_layerMas[key.layer][key.key];
+int Layout::getNextLayer(Key key) const {
+	return getSymbolsRange(key).nextLayer;
+}
+
+//-----------------------------------------------------------------------------
+bool Layout::isLayerKey(Key key) const {
+	const SymbolsRange& range = getSymbolsRange(key);
+	return range.size == 0 && range.nextLayer != -1;
+}
+
+//-----------------------------------------------------------------------------
+const Layout::SymbolsRange& Layout::getSymbolsRange(Key key) const {
+	return m_symbolsIndex[key.layer * size() + key.key];
 }
 
 //-----------------------------------------------------------------------------
 const Keys& Layout::getKeys(wchar_t letter) const {
-	return m_keyMap.at(letter);
+	static const Keys empty;
+
+	std::uint32_t index = 0;
+	int slot = getDenseSlot(letter);
+	if (slot != -1) {
+		if (slot < m_denseKeyIndex.size())
+			index = m_denseKeyIndex[slot];
+	} else {
+		auto found = m_sparseKeyIndex.find(letter);
+		if (found != m_sparseKeyIndex.end())
+			index = found->second;
+	}
+
+	return (index == 0) ? empty : m_keyLists[index - 1];
+}
+
+//-----------------------------------------------------------------------------
+int Layout::getDenseSlot(wchar_t letter) {
+	if (letter >= 0 && letter < 0x0500)
+		return letter;
+	if (letter >= 0x2000 && letter < 0x2070)
+		return 0x0500 + letter - 0x2000;
+	return -1;
+}
+
+//-----------------------------------------------------------------------------
+const OutputsMatcher& Layout::getMatcher(void) const {
+	return m_matcher;
+}
+
+//-----------------------------------------------------------------------------
+int Layout::getLayersCount(void) const {
+	return m_layersCount;
+}
+
+//-----------------------------------------------------------------------------
+std::uint64_t Layout::getFingerprint(void) const {
+	return m_fingerprint;
 }
 
 //-----------------------------------------------------------------------------
 const std::vector<KeyPoses>& Layout::getLayerKeys(int currentLayer, int toLayer) const {
-	try {
-		return m_layerMap.at({currentLayer, toLayer});
-	} catch (...) {
-		return {};
-	}
+	static const std::vector<KeyPoses> empty;
+
+	if (currentLayer < 0 || currentLayer >= m_layersCount || toLayer < 0 || toLayer >= m_layersCount)
+		return empty;
+	return m_layerKeys[currentLayer * m_layersCount + toLayer];
 }
 
 //-----------------------------------------------------------------------------
@@ -372,49 +829,61 @@ const std::vector<Layout::LayoutSymbols>& Layout::getLayoutInnerFormat(void) con
 //-----------------------------------------------------------------------------
 std::wstring Layout::typeTaps(const Taps& taps, PhysicalState& state) const {
 	std::wstring result;
-	for (auto& i : taps) {
-		auto symbols = getSymbols({ state.getCurrentLayer(), i.key });
-		auto isCurrentFingerBusy = state.isFingerBusy(getHand(i.key), getFinger(i.key));
-		auto isLayerKey = getLayer(symbols[0]);
-		if (i.press != PRESS_ONCE) {
-			if (i.press == PRESS_DOWN) {
-				if (isCurrentFingerBusy || !isLayerKey) {
-					throw std::exception("You tried to busy busied finger or to busy not layer key.");
-				} else {
-					state.busyFinger(getHand(i.key), getFinger(i.key), i.key, *isLayerKey);
-				}
-			} else {
-				if (!isCurrentFingerBusy || *isCurrentFingerBusy != i.key) {
-					throw std::exception("You tried to unbusied wrong finger.");
-				} else {
-					state.unbusyFinger(getHand(i.key), getFinger(i.key));
-				}
-			}
+	switch (typeTaps(taps, state, result).error) {
+		case TYPE_OK:
+			return result;
+		case TYPE_ERROR_BUSY_FINGER_DOWN:
+		case TYPE_ERROR_NOT_LAYER_KEY_DOWN:
+			throw std::exception("You tried to busy busied finger or to busy not layer key.");
+		case TYPE_ERROR_WRONG_FINGER_UP:
+			throw std::exception("You tried to unbusied wrong finger.");
+		default:
+			throw std::exception("You tried to press key by busied finger.");
+	}
+}
+
+//-----------------------------------------------------------------------------
+TypeResult Layout::typeTaps(const Taps& taps, PhysicalState& state, std::wstring& output) const {
+	return typeTaps(taps.data(), taps.size(), state, output);
+}
+
+//-----------------------------------------------------------------------------
+TypeResult Layout::typeTaps(const Tap* taps, int count, PhysicalState& state, std::wstring& output) const {
+	const std::uint8_t* hands = getHands();
+	const std::uint8_t* fingers = getFingers();
+	for (int j = 0; j < count; ++j) {
+		const Tap& i = taps[j];
+		Hand hand = Hand(hands[i.key]);
+		Finger finger = Finger(fingers[i.key]);
+		Key key = { state.getCurrentLayer(), i.key };
+		auto isCurrentFingerBusy = state.isFingerBusy(hand, finger);
+		if (i.press == PRESS_DOWN) {
+			if (isCurrentFingerBusy)
+				return {TYPE_ERROR_BUSY_FINGER_DOWN, j};
+			if (!isLayerKey(key))
+				return {TYPE_ERROR_NOT_LAYER_KEY_DOWN, j};
+			state.busyFinger(hand, finger, i.key, getNextLayer(key));
+		} else if (i.press == PRESS_UP) {
+			if (!isCurrentFingerBusy || *isCurrentFingerBusy != i.key)
+				return {TYPE_ERROR_WRONG_FINGER_UP, j};
+			state.unbusyFinger(hand, finger);
 		} else {
-			if (isCurrentFingerBusy) {
-				throw std::exception("You tried to press key by busied finger.");
-			} else {
-				auto layer = getLayer(symbols.back());
-				if (layer) {
-					state.addOneTap(*layer);
-					symbols.pop_back();
-				}
-				result += symbols;
-			}
+			if (isCurrentFingerBusy)
+				return {TYPE_ERROR_BUSY_FINGER_PRESS, j};
+			int nextLayer = getNextLayer(key);
+			if (nextLayer != -1)
+				state.addOneTap(nextLayer);
+			output += getOutput(key);
 		}
 	}
-	return result;
+	return {TYPE_OK, -1};
 }
 
 //-----------------------------------------------------------------------------
 std::wstring Layout::typeKeys(const Keys& keys) const {
 	std::wstring result;
-	for (const auto& i : keys) {
-		auto add = getSymbols(i);
-		if (getLayer(add.back()))
-			add.pop_back();
-		result += add;
-	}
+	for (const auto& i : keys)
+		result += getOutput(i);
 	return result;
 }
 
@@ -449,195 +918,480 @@ void readFromFile(Layout& layout, std::string layoutFile, std::string keyboardFi
 Typer::Typer(const Layout& layout) : m_layout(layout) {
 }
 
+//-----------------------------------------------------------------------------
+const Layout& Typer::getLayout(void) const {
+	return m_layout;
+}
+
 //-----------------------------------------------------------------------------
 //-----------------------------------------------------------------------------
 //-----------------------------------------------------------------------------
 
 //-----------------------------------------------------------------------------
-std::vector<Keys> decomposeToKeys(const Layout& layout, const std::wstring& text, int maxOneHandSize, int& symbolsCount) {
-	std::vector<int> variants(text.size(), 0);
-	for (int i = 0; i < text.size(); ++i)
-		variants[i] = layout.getKeys(text[i]).size();
+KeyLattice buildFirstPartLattice(const Layout& layout, std::wstring_view text, int maxOneHandSize, int& symbolsCount) {
+	KeyLattice lattice;
+	buildFirstPartLattice(layout, text, maxOneHandSize, symbolsCount, lattice);
+	return lattice;
+}
 
-	std::vector<Keys> allVariants;
+//-----------------------------------------------------------------------------
+void buildFirstPartLattice(const Layout& layout, std::wstring_view text, int maxOneHandSize, int& symbolsCount, KeyLattice& lattice) {
+	// Находим максимальную длину первой однорукой части. В reachable лежит маска рук, одной из которых можно набрать все символы от начала текста до текущего, поэтому каждый символ просматривается один раз. Как только маска пустеет, часть кончилась.
+	// Длина части всё равно ограничивается maxOneHandSize, поэтому символы дальше не просматриваются
+	if (maxOneHandSize < 1)
+		throw std::exception();
+	int scanSize = std::min<int>(text.size(), maxOneHandSize);
+	const std::uint8_t* keyHands = layout.getHands();
+	symbolsCount = std::min<int>(text.size(), 1);
+	unsigned reachable = ~0u;
+	for (int i = 0; i < scanSize; ++i) {
+		unsigned hands = 0;
+		for (const auto& key : layout.getKeys(text[i]))
+			hands |= 1u << keyHands[key.key];
+
+		reachable &= hands;
+		if (reachable == 0)
+			break;
+		symbolsCount = i + 1;
+	}
 
-	// Находим максимальную длину первой однорукой части
-	{
-		symbolsCount = 0;
-		Number num(variants);
-		do {
-			auto res = num.get();
+	// Модифицируем данные, чтобы они соответствовали выбранной длине
+	if (symbolsCount > maxOneHandSize)
+		symbolsCount = maxOneHandSize;
+
+	// Если часть нельзя набрать целиком, потому что клавиша с несколькими символами выходит за её границу, то часть увеличивается. Клавиша, которая начинается внутри части, заканчивается не дальше чем через самый длинный вывод минус один символ, поэтому дальше увеличивать бессмысленно: такую часть набрать нельзя.
+	int boundary = symbolsCount;
+	int maxSize = std::min<int>(text.size(), boundary + std::max(layout.getMatcher().getMaxMatchSize() - 1, 0));
+	lattice.assign(layout, text.substr(0, symbolsCount));
+	while (!lattice.isTypable() && symbolsCount < maxSize) {
+		symbolsCount++;
+		lattice.assign(layout, text.substr(0, symbolsCount));
+	}
+	if (!lattice.isTypable())
+		symbolsCount = boundary;
+}
 
-			auto lastHand = layout.getHand(layout.getKeys(text[0])[res[0]].key);
-			int i = 1;
-			while (lastHand == layout.getHand(layout.getKeys(text[i])[res[i]].key))
-				i++;
+//-----------------------------------------------------------------------------
+std::vector<Keys> decomposeToKeys(const Layout& layout, const std::wstring& text, int maxOneHandSize, int& symbolsCount) {
+	// Все варианты набора первой части — это все пути в её решётке
+	return buildFirstPartLattice(layout, text, maxOneHandSize, symbolsCount).getAllVariants();
+}
 
-			if (i > symbolsCount)
-				symbolsCount = i;
+//-----------------------------------------------------------------------------
+std::vector<Taps> decomposeToTaps(const Layout& layout, const Keys& keys, PhysicalState& state) {
+	/** 
+	Критерий, чтобы сделать зажатие клавиши для включения некоторого слоя:
+	Более 1 буквы набирается в другом и одном и том же слое. 
+	1 буква и одна клавиша для включения другого слоя набираются в другом слое.
+	Когда отключать слои?
+	Емоё, как всё сложно.
+	Мне действительно это нужно? :)
+	 */
+	// Зажимать ли клавишу слоя, решает decomposeToTaps со стоимостью: здесь каждое нажатие стоит одинаково
+	double cost;
+	Taps taps = decomposeToTaps(layout, keys, state, [] (const Tap&) -> double {
+		return 1;
+	}, cost);
 
-			num++;
-		} while (!num.isEnd());
+	if (cost == std::numeric_limits<double>::infinity())
+		return {};
+	return {taps};
+}
 
-		// Модифицируем данные, чтобы они соответствовали выбранной длине
-		if (symbolsCount > maxOneHandSize)
-			symbolsCount = maxOneHandSize;
+//-----------------------------------------------------------------------------
+bool applyTap(const Layout& layout, Tap tap, std::wstring_view expected, PhysicalState& state) {
+	std::wstring output;
+	return layout.typeTaps(&tap, 1, state, output).error == TYPE_OK && output == expected;
+}
+
+//-----------------------------------------------------------------------------
+void visitSilentTaps(const Layout& layout, const PhysicalState& state, bool isSwitchLayer, const TapTransitionVisitor& visitor) {
+	const std::uint16_t* fingerIds = layout.getFingerIds();
+
+	// Переключаем слой однократным нажатием или зажатием клавиши слоя
+	if (isSwitchLayer) {
+		PhysicalState probe = state;
+		int layer = probe.getCurrentLayer();
+		for (KeyPos i = 0; i < layout.size(); ++i) {
+			if (!layout.isLayerKey({layer, i}))
+				continue;
+			for (Press press : {PRESS_ONCE, PRESS_DOWN}) {
+				// Клавишу без определенного пальца зажать нельзя
+				if (press == PRESS_DOWN && fingerIds[i] == NO_FINGER_ID)
+					continue;
+				Tap tap = {i, press};
+				PhysicalState next = state;
+				if (applyTap(layout, tap, L"", next))
+					visitor(tap, next);
+			}
+		}
+	}
 
-		variants = std::vector<int>(variants.begin(), variants.begin() + symbolsCount);
+	// Отпускаем любую зажатую клавишу: это возвращает предыдущий слой или освобождает палец
+	std::uint16_t busyMask = state.getBusyMask();
+	for (int finger = 0; finger < FINGERS_COUNT; ++finger) {
+		if (!(busyMask & (1 << finger)))
+			continue;
+		KeyPos held = *state.isFingerBusy(Hand(finger / 5 + 1), Finger(finger % 5 + 1));
+		Tap tap = {held, PRESS_UP};
+		PhysicalState next = state;
+		if (applyTap(layout, tap, L"", next))
+			visitor(tap, next);
 	}
+}
 
-	// Перебираем все варианты
-	Number num(variants);
-	do {
-		auto res = num.get();
-
-		// Формируем какие строки будут после каждого нажатия
-		std::vector<std::wstring> strings(text.size());
-		std::vector<Key> keys(text.size());
-		for (int i = 0; i < text.size(); ++i) {
-			keys[i] = layout.getKeys(text[i])[res[i]];
-			strings[i] = layout.getSymbols(keys[i]);
+//-----------------------------------------------------------------------------
+Taps decomposeToTaps(const Layout& layout, const Keys& keys, const PhysicalState& state, const TapCost& cost, double& resultCost) {
+	resultCost = std::numeric_limits<double>::infinity();
+
+	// Вершина — позиция в keys и физическое состояние перед следующим нажатием
+	struct Node
+	{
+		int 			pos;
+		PhysicalState 	state;
+		double 			cost;
+		int 			parent;
+		Tap 			tap; // Нажатие, по которому пришли из parent
+		bool 			done;
+	};
+
+	struct NodeKey
+	{
+		int 			pos;
+		PhysicalState 	state;
+
+		bool operator==(const NodeKey& other) const {
+			return pos == other.pos && state == other.state;
 		}
+	};
 
-		// Убираем лишние части, если есть строки с несколькими символами, если они подходят, если не подходят, то этот вариант проигрышный. Так же здесь фильтруем автоматическое переключение слоя
-		int pos = 0;
-		for (int i = 0; i < strings.size(); ++i) {
-			if (strings[i].size() != 1) {
-				// Проверяем, чтобы дальнейший текст соответствовал тому, что автоматически наберется в клавише с несколькими символами
-				for (int j = 0; j < strings[i].size(); ++j) {
-					if (!getLayer(strings[i][j]))
-						if (pos + j < text.size()) {
-							if (text[pos + j] != strings[i][j])
-								goto next_variant;
-						} else
-							goto next_variant;
-				}
+	struct NodeKeyHash
+	{
+		std::size_t operator()(const NodeKey& key) const {
+			return key.state.getHash() * 31 + key.pos;
+		}
+	};
 
-				// Удаляем все варианты, которые идут после клавиш с несколькими символами
-				for (int j = 1; j < strings[i].size(); ++j) {
-					if (!getLayer(strings[i][j]) && i < strings.size() - 1) {
-						strings.erase(strings.begin() + i + 1);
-						keys.erase(keys.begin() + i + 1);
-					} 
-				}
-			}
+	std::vector<Node> nodes;
+	std::unordered_map<NodeKey, int, NodeKeyHash> index;
+	typedef std::pair<double, int> QueueItem;
+	std::priority_queue<QueueItem, std::vector<QueueItem>, std::greater<QueueItem>> queue;
+
+	auto relax = [&] (int pos, const PhysicalState& next, double nextCost, int parent, Tap tap) {
+		auto found = index.find({pos, next});
+		if (found == index.end()) {
+			index[{pos, next}] = nodes.size();
+			nodes.push_back({pos, next, nextCost, parent, tap, false});
+			queue.push({nextCost, int(nodes.size()) - 1});
+		} else if (nextCost < nodes[found->second].cost) {
+			Node& node = nodes[found->second];
+			node.cost = nextCost;
+			node.parent = parent;
+			node.tap = tap;
+			queue.push({nextCost, found->second});
+		}
+	};
 
-			// Если в клавише есть переключение следующего слоя, то следующая клавиша должна быть на этом слое
-			auto nextLayer = getLayer(strings[i].back());
-			if (nextLayer && i+1 < keys.size() && keys[i+1].layer != *nextLayer)
-				goto next_variant;
+	relax(0, state, 0, -1, {0, PRESS_ONCE});
+	int end = -1;
+	while (!queue.empty()) {
+		int current = queue.top().second;
+		queue.pop();
+		if (nodes[current].done)
+			continue;
+		nodes[current].done = true;
+
+		int pos = nodes[current].pos;
+		double currentCost = nodes[current].cost;
+		if (pos == keys.size()) {
+			end = current;
+			break;
+		}
 
-			pos += strings[i].size();
-			if (getLayer(strings[i].back()))
-				pos--;
+		const Key& key = keys[pos];
+		// Копия, так как relax добавляет вершины и ссылка на nodes может стать недействительной
+		const PhysicalState currentState = nodes[current].state;
+		PhysicalState probe = currentState;
+		int layer = probe.getCurrentLayer();
+
+		if (layer == key.layer) {
+			// Набираем следующую клавишу
+			Tap tap = {key.key, PRESS_ONCE};
+			PhysicalState next = currentState;
+			if (applyTap(layout, tap, layout.getOutput(key), next))
+				relax(pos + 1, next, currentCost + cost(tap), current, tap);
 		}
 
-		// Формируем массив следующих клавиш, где записывается информация касательно слоя
-		allVariants.push_back(keys);
+		// Слой переключаем, только если он не тот, а зажатую клавишу можно отпустить всегда
+		visitSilentTaps(layout, currentState, layer != key.layer, [&] (const Tap& tap, const PhysicalState& next) {
+			relax(pos, next, currentCost + cost(tap), current, tap);
+		});
+	}
 
-		next_variant:
-		num++;
-	} while (!num.isEnd());
+	if (end == -1)
+		return {};
 
-	return allVariants;
+	Taps result;
+	for (int node = end; nodes[node].parent != -1; node = nodes[node].parent)
+		result.push_back(nodes[node].tap);
+	std::reverse(result.begin(), result.end());
+	resultCost = nodes[end].cost;
+	return result;
 }
 
 //-----------------------------------------------------------------------------
-std::vector<Taps> decomposeToTaps(const Layout& layout, const Keys& keys, PhysicalState& state) {
-	/** 
-	Критерий, чтобы сделать зажатие клавиши для включения некоторого слоя:
-	Более 1 буквы набирается в другом и одном и том же слое. 
-	1 буква и одна клавиша для включения другого слоя набираются в другом слое.
-	Когда отключать слои?
-	Емоё, как всё сложно.
-	Мне действительно это нужно? :)
-	 */
-	return {};
+std::vector<std::pair<KeyPoses, Hand>> splitByHands(const Keyboard& keyboard, const KeyPoses& keyPoses) {
+	const std::uint8_t* hands = keyboard.getHands();
+	std::vector<std::pair<KeyPoses, Hand>> parts;
+	for (const auto& i : keyPoses) {
+		if (parts.size() == 0)
+			parts.push_back({{i}, Hand(hands[i])});
+		else {
+			if (parts.back().second == hands[i]) {
+				parts.back().first.push_back(i);
+			} else {
+				parts.push_back({{i}, Hand(hands[i])});
+			}
+		}
+	}
+	return parts;
 }
 
 //-----------------------------------------------------------------------------
-std::vector<Accords> decomposeOneHandAccords(const Keyboard& keyboard, const KeyPoses& keyPoses) {
-	std::vector<Accords> result;
+bool isAccordOnDifferentFingers(const Keyboard& keyboard, const KeyPoses& keyPoses, int pos, int size) {
+	const std::uint16_t* fingerIds = keyboard.getFingerIds();
+	for (int i = pos; i < pos + size; ++i)
+		for (int j = i + 1; j < pos + size; ++j)
+			if (fingerIds[keyPoses[i]] == fingerIds[keyPoses[j]])
+				return false;
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+std::vector<std::uint64_t> findOneHandAccordsSplits(const Keyboard& keyboard, const KeyPoses& keyPoses) {
+	const std::uint16_t* fingerIds = keyboard.getFingerIds();
+	std::vector<std::uint64_t> result;
 	Compositions comp(keyPoses.size());
 	int pos;
-	Accords accords;
 	do {
 		// Сначала проверяется чтобы каждый аккорд был на разных пальцах
-		auto res = comp.get();
+		const unsigned char* res = comp.getParts();
+		int count = comp.getPartsCount();
 		pos = 0;
-		for (const auto& i : res) {
-			for (int j = 1; j < i; ++j) {
-				if (keyboard.getFinger(keyPoses[pos]) == keyboard.getFinger(keyPoses[pos + j]))
-					goto not_push;
-			}
-			pos += i;
+		for (int i = 0; i < count; ++i) {
+			if (!isAccordOnDifferentFingers(keyboard, keyPoses, pos, res[i]))
+				goto not_push;
+			pos += res[i];
 		}
 
 		// Далее проверяется, чтобы не было аккордов из одной буквы, если они не на одном пальце
 		pos = 0;
-		for (int i = 0; i < res.size() - 1; ++i) {
+		for (int i = 0; i < count - 1; ++i) {
 			if (res[i] == 1 && res[i + 1] == 1 &&
-				keyboard.getFinger(keyPoses[pos]) != keyboard.getFinger(keyPoses[pos + 1]))
+				fingerIds[keyPoses[pos]] != fingerIds[keyPoses[pos + 1]])
 				goto not_push;
 
 			pos += res[i];
 		}
 
 		// Если все проверки пройдены, то только тогда этот варивант можно положить
-		pos = 0;
-		accords.clear();
-		for (int i = 0; i < res.size(); ++i) {
-			accords.push_back({});
-			for (int j = 0; j < i; ++j) {
-				accords.back().push_back(keyPoses[pos]);
-				pos++;
-			}
-		}
-		result.push_back(accords);
+		result.push_back(comp.getSplits());
 		not_push:;
 
 		comp++;
-	} while (comp.isEnd());
+	} while (!comp.isEnd());
+
+	return result;
+}
+
+//-----------------------------------------------------------------------------
+std::vector<Accords> decomposeOneHandAccords(const Keyboard& keyboard, const KeyPoses& keyPoses) {
+	std::vector<std::uint64_t> uncached;
+	const std::vector<std::uint64_t>* splits = &uncached;
+	if (keyPoses.size() <= Keyboard::MAX_CACHED_ACCORDS_SIZE)
+		splits = &keyboard.getOneHandAccordsSplits(keyPoses);
+	else
+		uncached = findOneHandAccordsSplits(keyboard, keyPoses);
+
+	// Превращаем каждую маску разрезов в аккорды
+	std::vector<Accords> result;
+	std::vector<unsigned char> res(keyPoses.size());
+	for (const auto& i : *splits) {
+		int count = getCompositionParts(keyPoses.size(), i, res.data());
+		int pos = 0;
+		result.push_back({});
+		for (int j = 0; j < count; ++j) {
+			result.back().push_back(Accord(keyPoses.begin() + pos, keyPoses.begin() + pos + res[j]));
+			pos += res[j];
+		}
+	}
 
 	return result;
 }
 
 //-----------------------------------------------------------------------------
 std::vector<Accords> decomposeToAccords(const Keyboard& keyboard, const KeyPoses& keyPoses) {
-	// Формируем части каждой руки
-	std::vector<std::pair<KeyPoses, Hand>> parts;
-	for (const auto& i : keyPoses) {
-		if (parts.size() == 0)
-			parts.push_back({{i}, keyboard.getHand(i) });
-		else {
-			if (parts.back().second == keyboard.getHand(i)) {
-				parts.back().first.push_back(i);
-			} else {
-				parts.push_back({{i}, keyboard.getHand(i)});
-			}
+	AccordsVariants variants(keyboard, keyPoses);
+
+	// Перебираем все эти варианты и помещаем в результат
+	std::vector<Accords> result(variants.size());
+	for (long long i = 0; i < variants.size(); ++i)
+		variants.get(i, result[i]);
+
+	return result;
+}
+
+//-----------------------------------------------------------------------------
+void decomposeOneHandAccords_r(
+	const Keyboard& keyboard,
+	const KeyPoses& keyPoses,
+	const std::vector<std::vector<double>>& accordCost,
+	const std::vector<double>& lowerBound,
+	int pos,
+	int lastSize,
+	Accords& current,
+	double currentCost,
+	Accords& best,
+	double& bestCost,
+	SearchStats& stats
+) {
+	if (pos == keyPoses.size()) {
+		if (currentCost < bestCost) {
+			best = current;
+			bestCost = currentCost;
+		}
+		return;
+	}
+
+	for (int size = 1; pos + size <= keyPoses.size(); ++size) {
+		double cost = accordCost[pos][size];
+		if (cost == std::numeric_limits<double>::infinity())
+			continue;
+		if (size == 1 && lastSize == 1 && 
+			keyboard.getFingerIds()[keyPoses[pos - 1]] != keyboard.getFingerIds()[keyPoses[pos]])
+			continue;
+
+		stats.visited++;
+		if (currentCost + cost + lowerBound[pos + size] >= bestCost) {
+			stats.pruned++;
+			continue;
 		}
+
+		current.push_back(Accord(keyPoses.begin() + pos, keyPoses.begin() + pos + size));
+		decomposeOneHandAccords_r(keyboard, keyPoses, accordCost, lowerBound, pos + size, size, current, currentCost + cost, best, bestCost, stats);
+		current.pop_back();
 	}
+}
+
+//-----------------------------------------------------------------------------
+Accords decomposeOneHandAccords(const Keyboard& keyboard, const KeyPoses& keyPoses, const AccordCost& cost, double& resultCost, SearchStats& stats) {
+	const double inf = std::numeric_limits<double>::infinity();
+	int n = keyPoses.size();
+
+	// Стоимость каждого допустимого аккорда keyPoses[pos..pos+size)
+	std::vector<std::vector<double>> accordCost(n, std::vector<double>(n + 1, inf));
+	for (int pos = 0; pos < n; ++pos)
+		for (int size = 1; pos + size <= n; ++size)
+			if (isAccordOnDifferentFingers(keyboard, keyPoses, pos, size))
+				accordCost[pos][size] = cost(Accord(keyPoses.begin() + pos, keyPoses.begin() + pos + size));
+
+	// Нижняя оценка стоимости набора оставшихся клавиш: лучшее разложение без учета запрета на соседние одиночные аккорды
+	std::vector<double> lowerBound(n + 1, inf);
+	lowerBound[n] = 0;
+	for (int pos = n - 1; pos >= 0; --pos)
+		for (int size = 1; pos + size <= n; ++size)
+			lowerBound[pos] = std::min(lowerBound[pos], accordCost[pos][size] + lowerBound[pos + size]);
+
+	Accords current, best;
+	resultCost = inf;
+	decomposeOneHandAccords_r(keyboard, keyPoses, accordCost, lowerBound, 0, 0, current, 0, best, resultCost, stats);
+	return best;
+}
 
+//-----------------------------------------------------------------------------
+Accords decomposeToAccords(const Keyboard& keyboard, const KeyPoses& keyPoses, const AccordCost& cost, double& resultCost, SearchStats& stats) {
+	Accords result;
+	resultCost = 0;
+	for (const auto& i : splitByHands(keyboard, keyPoses)) {
+		double partCost;
+		auto part = decomposeOneHandAccords(keyboard, i.first, cost, partCost, stats);
+		resultCost += partCost;
+		result.insert(result.end(), part.begin(), part.end());
+	}
+	return result;
+}
+
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+
+//-----------------------------------------------------------------------------
+AccordsVariants::AccordsVariants(const Keyboard& keyboard, const KeyPoses& keyPoses) : m_size(1) {
 	// Получаем все варианты набора каждой рукой
-	std::vector<std::vector<Accords>> allVariants;
-	std::vector<int> variants;
-	for (const auto& i : parts) {
-		allVariants.push_back(decomposeOneHandAccords(keyboard, i.first));
-		variants.push_back(allVariants.back().size());
+	for (const auto& i : splitByHands(keyboard, keyPoses)) {
+		m_parts.push_back(decomposeOneHandAccords(keyboard, i.first));
+
+		long long count = m_parts.back().size();
+		if (count != 0 && m_size > std::numeric_limits<long long>::max() / count)
+			m_size = std::numeric_limits<long long>::max();
+		else
+			m_size *= count;
 	}
+}
 
-	// Перебираем все эти варианты и помещаем в результат
-	std::vector<Accords> result;
-	Number num(variants);
-	do {
-		auto res = num.get();
-		result.push_back({});
-		for (int i = 0; i < res.size(); ++i) {
-			result.back().insert(result.back().end(), allVariants[i][res[i]].begin(), allVariants[i][res[i]].begin());
+//-----------------------------------------------------------------------------
+long long AccordsVariants::size(void) const {
+	return m_size;
+}
+
+//-----------------------------------------------------------------------------
+int AccordsVariants::getPartsCount(void) const {
+	return m_parts.size();
+}
+
+//-----------------------------------------------------------------------------
+const std::vector<Accords>& AccordsVariants::getPart(int part) const {
+	return m_parts[part];
+}
+
+//-----------------------------------------------------------------------------
+Accords AccordsVariants::get(long long index) const {
+	Accords result;
+	get(index, result);
+	return result;
+}
+
+//-----------------------------------------------------------------------------
+void AccordsVariants::get(long long index, Accords& result) const {
+	result.clear();
+	for (const auto& part : m_parts) {
+		const Accords& accords = part[index % part.size()];
+		index /= part.size();
+		result.insert(result.end(), accords.begin(), accords.end());
+	}
+}
+
+//-----------------------------------------------------------------------------
+Accords AccordsVariants::getOptimal(const AccordCost& cost, double& resultCost) const {
+	Accords result;
+	resultCost = 0;
+	for (const auto& part : m_parts) {
+		int best = -1;
+		double bestCost = std::numeric_limits<double>::infinity();
+		for (int i = 0; i < part.size(); ++i) {
+			double current = 0;
+			for (const auto& accord : part[i])
+				current += cost(accord);
+			if (current < bestCost) {
+				bestCost = current;
+				best = i;
+			}
 		}
-		num++;
-	} while (!num.isEnd());
 
+		resultCost += bestCost;
+		if (best != -1)
+			result.insert(result.end(), part[best].begin(), part[best].end());
+	}
 	return result;
 }
 
@@ -695,54 +1449,195 @@ double RealTyper::type(const Accords& accords) {
 	return {};
 }
 
+//-----------------------------------------------------------------------------
+// Непрерывные диапазоны символов с числами в кружке и номер слоя первого символа диапазона
+struct LayerSymbolsRange
+{
+	wchar_t first;
+	wchar_t last;
+	int 	layer;
+};
+
+static const LayerSymbolsRange layerSymbolsRanges[] = {
+	{L'\x24EA', L'\x24EA', 0},  // ⓪
+	{L'\x2460', L'\x2473', 1},  // ①..⑳
+	{L'\x3251', L'\x325F', 21}, // ㉑..㉟
+	{L'\x32B1', L'\x32BF', 36}, // ㊱..㊿
+};
+
 //-----------------------------------------------------------------------------
 std::optional<int> getLayer(wchar_t symbol) {
-	switch (symbol)	 {
-		case L'⓪':
-			return 0;
-		case L'①':
-			return 1;
-		case L'②':
-			return 2;
-		case L'③':
-			return 3;
-		case L'④':
-			return 4;
-		case L'⑤':
-			return 5;
-		case L'⑥':
-			return 6;
-		case L'⑦':
-			return 7;
-		case L'⑧':
-			return 8;
-		case L'⑨':
-			return 9;
-		case L'⑩':
-			return 10;
-		case L'⑪':
-			return 11;
-		case L'⑫':
-			return 12;
-		case L'⑬':
-			return 13;
-		case L'⑭':
-			return 14;
-		case L'⑮':
-			return 15;
-		case L'⑯':
-			return 16;
-		case L'⑰':
-			return 17;
-		case L'⑱':
-			return 18;
-		case L'⑲':
-			return 19;
-		case L'⑳':
-			return 20;
-	};
+	// Почти все символы текста меньше первого символа слоя, для них хватает одного сравнения
+	if (symbol < L'\x2460' || symbol > L'\x32BF')
+		return std::nullopt;
+
+	for (const auto& i : layerSymbolsRanges)
+		if (symbol >= i.first && symbol <= i.last)
+			return i.layer + (symbol - i.first);
 
 	return std::nullopt;
 }
 
+//-----------------------------------------------------------------------------
+wchar_t getLayerSymbol(int layer) {
+	for (const auto& i : layerSymbolsRanges)
+		if (layer >= i.layer && layer <= i.layer + (i.last - i.first))
+			return i.first + (layer - i.layer);
+
+	throw std::exception();
+}
+
+//-----------------------------------------------------------------------------
+std::vector<std::uint64_t> getLayerMarkers(const std::wstring& text) {
+	std::vector<std::uint64_t> result((text.size() + 63) / 64, 0);
+	for (int i = 0; i < text.size(); ++i)
+		if (getLayer(text[i]))
+			result[i / 64] |= std::uint64_t(1) << (i % 64);
+	return result;
+}
+
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+
+//-----------------------------------------------------------------------------
+TapsStream::TapsStream(const Layout& layout, const PhysicalState& state, const TextSink& sink) : m_layout(layout), m_state(state), m_sink(sink), m_tapsCount(0), m_result({TYPE_OK, -1}) {
+}
+
+//-----------------------------------------------------------------------------
+TypeResult TapsStream::write(const Tap* taps, int count) {
+	if (m_result.error != TYPE_OK)
+		return m_result;
+
+	m_buffer.clear();
+	TypeResult result = m_layout.typeTaps(taps, count, m_state, m_buffer);
+	if (!m_buffer.empty())
+		m_sink(m_buffer);
+
+	if (result.error != TYPE_OK) {
+		m_tapsCount += result.tap;
+		m_result = {result.error, m_tapsCount};
+	} else
+		m_tapsCount += count;
+	return m_result;
+}
+
+//-----------------------------------------------------------------------------
+TypeResult TapsStream::write(const Taps& taps) {
+	return write(taps.data(), taps.size());
+}
+
+//-----------------------------------------------------------------------------
+const PhysicalState& TapsStream::getState(void) const {
+	return m_state;
+}
+
+//-----------------------------------------------------------------------------
+long long TapsStream::getTapsCount(void) const {
+	return m_tapsCount;
+}
+
+//-----------------------------------------------------------------------------
+TypeResult TapsStream::getResult(void) const {
+	return m_result;
+}
+
+//-----------------------------------------------------------------------------
+TypeResult typeTaps(const Layout& layout, const TapsSource& source, PhysicalState& state, const TextSink& sink) {
+	TapsStream stream(layout, state, sink);
+	Taps taps;
+	while (source(taps)) {
+		if (stream.write(taps).error != TYPE_OK)
+			break;
+	}
+	state = stream.getState();
+	return stream.getResult();
+}
+
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+
+//-----------------------------------------------------------------------------
+TextTyping typeText(Typer& typer, const std::wstring& text, int maxOneHandSize, PhysicalState& state) {
+	if (maxOneHandSize < 1)
+		throw std::exception();
+
+	const Layout& layout = typer.getLayout();
+	TextTyping result = {0, {}, 0};
+
+	// Буферы переживают части текста, поэтому память выделяется только пока они растут
+	KeyLattice 				lattice;
+	std::vector<Taps> 		taps; // Варианты нажатий для всех вариантов клавиш части
+	std::vector<Accords> 	accords; // Варианты аккордов для всех вариантов нажатий, ровно столько, сколько их в текущей части
+	std::vector<Accords> 	spareAccords; // Лишние варианты с прошлых частей, откладываются вместе со своей памятью
+	std::vector<int> 		accordsTaps; // Номер варианта нажатий, из которого получился вариант аккордов
+	KeyPoses 				keyPoses;
+	std::wstring 			output;
+
+	std::wstring_view rest = text;
+	while (!rest.empty()) {
+		int symbolsCount;
+		buildFirstPartLattice(layout, rest, maxOneHandSize, symbolsCount, lattice);
+		if (!lattice.isTypable())
+			break;
+
+		int tapsCount = 0;
+		for (KeyVariants keys(lattice); !keys.isEnd(); keys++) {
+			for (auto& i : decomposeToTaps(layout, keys.get(), state)) {
+				if (tapsCount == taps.size())
+					taps.emplace_back();
+				taps[tapsCount++].swap(i);
+			}
+		}
+
+		int accordsCount = 0;
+		accordsTaps.clear();
+		for (int i = 0; i < tapsCount; ++i) {
+			keyPoses.clear();
+			for (const auto& tap : taps[i])
+				if (tap.press != PRESS_UP)
+					keyPoses.push_back(tap.key);
+
+			AccordsVariants variants(layout, keyPoses);
+			for (long long j = 0; j < variants.size(); ++j) {
+				if (accordsCount == accords.size()) {
+					if (spareAccords.empty())
+						accords.emplace_back();
+					else {
+						accords.push_back(std::move(spareAccords.back()));
+						spareAccords.pop_back();
+					}
+				}
+				variants.get(j, accords[accordsCount++]);
+				accordsTaps.push_back(i);
+			}
+		}
+
+		// Typer получает ровно варианты этой части, а лишние не уничтожаются
+		while (accords.size() > accordsCount) {
+			spareAccords.push_back(std::move(accords.back()));
+			accords.pop_back();
+		}
+		if (accordsCount == 0)
+			break;
+
+		int best = typer.getOptimalAccords(accords);
+		if (best < 0 || best >= accordsCount)
+			throw std::exception();
+		result.time += typer.type(accords[best]);
+		result.accords.insert(result.accords.end(), accords[best].begin(), accords[best].end());
+
+		// Набираем выбранный вариант, чтобы перейти в физическое состояние после него. Заодно проверяем, что он действительно набирает эту часть текста.
+		output.clear();
+		if (layout.typeTaps(taps[accordsTaps[best]], state, output).error != TYPE_OK || output != rest.substr(0, symbolsCount))
+			throw std::exception();
+
+		result.typedSize += symbolsCount;
+		rest.remove_prefix(symbolsCount);
+	}
+
+	return result;
+}
+
 };
\ No newline at end of file
@@ -0,0 +1,573 @@
+﻿#include <algorithm>
+#include <limits>
+#include <queue>
+#include <unordered_map>
+
+#include <kbd/lattice.h>
+
+namespace kbd
+{
+
+//-----------------------------------------------------------------------------
+void TextMatches::assign(const OutputsMatcher& matcher, std::wstring_view text) {
+	// Одним проходом автомата находим все места текста, где вывод клавиши совпадает с текстом
+	int textSize = text.size();
+	m_found.clear();
+	int state = matcher.getStartState();
+	for (int end = 0; end < textSize; ++end) {
+		state = matcher.next(state, text[end]);
+		for (int match = matcher.getFirstMatch(state); match != -1; match = matcher.getNextMatch(match))
+			m_found.push_back({end + 1 - matcher.getMatchSize(match), match});
+	}
+
+	// Сортировка подсчётом: сначала в m_begin[pos] конец группы pos, потом, после раскладки с конца, её начало
+	m_begin.assign(textSize + 1, 0);
+	for (const auto& i : m_found)
+		m_begin[i.first]++;
+	for (int pos = 1; pos < textSize; ++pos)
+		m_begin[pos] += m_begin[pos - 1];
+	m_begin[textSize] = m_found.size();
+	m_matches.resize(m_found.size());
+	for (int i = m_found.size() - 1; i >= 0; --i)
+		m_matches[--m_begin[m_found[i].first]] = m_found[i].second;
+}
+
+//-----------------------------------------------------------------------------
+int TextMatches::getBegin(int pos) const {
+	return m_begin[pos];
+}
+
+//-----------------------------------------------------------------------------
+int TextMatches::getEnd(int pos) const {
+	return m_begin[pos + 1];
+}
+
+//-----------------------------------------------------------------------------
+int TextMatches::get(int i) const {
+	return m_matches[i];
+}
+
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+
+//-----------------------------------------------------------------------------
+KeyLattice::KeyLattice() : m_textSize(0), m_layerStates(1), m_startLayer(-1) {
+}
+
+//-----------------------------------------------------------------------------
+KeyLattice::KeyLattice(const Layout& layout, std::wstring_view text, int startLayer) {
+	assign(layout, text, startLayer);
+}
+
+//-----------------------------------------------------------------------------
+int KeyLattice::getTextSize(void) const {
+	return m_textSize;
+}
+
+//-----------------------------------------------------------------------------
+bool KeyLattice::isTypable(void) const {
+	return !m_alive.empty() && m_alive[getStartNode()];
+}
+
+//-----------------------------------------------------------------------------
+double KeyLattice::getVariantsCount(void) const {
+	if (!isTypable())
+		return 0;
+
+	std::vector<double> count(m_alive.size(), 0);
+	for (int node = m_alive.size() - 1; node >= 0; --node) {
+		if (!m_alive[node])
+			continue;
+		if (isEndNode(node)) {
+			count[node] = 1;
+			continue;
+		}
+		for (int i = m_arcBegin[node]; i < m_arcBegin[node + 1]; ++i)
+			count[node] += count[m_arcs[i].to];
+	}
+
+	return count[getStartNode()];
+}
+
+//-----------------------------------------------------------------------------
+std::vector<Keys> KeyLattice::getAllVariants(void) const {
+	std::vector<Keys> result;
+	KeyVariants variants(*this);
+	while (!variants.isEnd()) {
+		result.push_back(variants.get());
+		variants++;
+	}
+	return result;
+}
+
+//-----------------------------------------------------------------------------
+Keys KeyLattice::getOptimal(const KeyCost& cost, double& resultCost) const {
+	resultCost = std::numeric_limits<double>::infinity();
+	if (!isTypable())
+		return {};
+
+	std::vector<double> arcCost, best;
+	std::vector<int> choice;
+	getSuffixCosts(cost, arcCost, best, choice);
+
+	Keys result;
+	int node = getStartNode();
+	while (!isEndNode(node)) {
+		result.push_back(m_arcs[choice[node]].key);
+		node = m_arcs[choice[node]].to;
+	}
+	resultCost = best[getStartNode()];
+	return result;
+}
+
+//-----------------------------------------------------------------------------
+Keys KeyLattice::getOptimal(const KeyCost& lowerBound, const KeysCost& cost, double& resultCost, SearchStats& stats) const {
+	resultCost = std::numeric_limits<double>::infinity();
+	if (!isTypable())
+		return {};
+
+	// Лучшая сумма нижних оценок от каждой вершины до конца текста
+	std::vector<double> arcCost, bound;
+	std::vector<int> choice;
+	getSuffixCosts(lowerBound, arcCost, bound, choice);
+
+	// Обход в глубину, на стеке хранится вершина, номер следующего ребра из неё и сумма нижних оценок пройденных клавиш
+	struct Frame
+	{
+		int node;
+		int arc;
+		double cost;
+	};
+
+	Keys keys, result;
+	std::vector<Frame> stack;
+	stack.push_back({getStartNode(), m_arcBegin[getStartNode()], 0});
+	while (!stack.empty()) {
+		Frame& top = stack.back();
+
+		if (isEndNode(top.node) || top.arc == m_arcBegin[top.node + 1]) {
+			if (isEndNode(top.node)) {
+				double current = cost(keys);
+				if (current < resultCost) {
+					resultCost = current;
+					result = keys;
+				}
+			}
+			stack.pop_back();
+			if (!keys.empty())
+				keys.pop_back();
+			continue;
+		}
+
+		int i = top.arc++;
+		const Arc& arc = m_arcs[i];
+		if (!m_alive[arc.to])
+			continue;
+
+		stats.visited++;
+		double partial = top.cost + arcCost[i];
+		if (partial + bound[arc.to] >= resultCost) {
+			stats.pruned++;
+			continue;
+		}
+
+		keys.push_back(arc.key);
+		stack.push_back({arc.to, m_arcBegin[arc.to], partial});
+	}
+
+	return result;
+}
+
+//-----------------------------------------------------------------------------
+int KeyLattice::getNode(int pos, int layer) const {
+	return pos * m_layerStates + layer + 1;
+}
+
+//-----------------------------------------------------------------------------
+int KeyLattice::getStartNode(void) const {
+	return getNode(0, m_startLayer);
+}
+
+//-----------------------------------------------------------------------------
+bool KeyLattice::isEndNode(int node) const {
+	return node >= m_textSize * m_layerStates;
+}
+
+//-----------------------------------------------------------------------------
+void KeyLattice::getSuffixCosts(const KeyCost& cost, std::vector<double>& arcCost, std::vector<double>& best, std::vector<int>& choice) const {
+	arcCost.assign(m_arcs.size(), 0);
+	best.assign(m_alive.size(), std::numeric_limits<double>::infinity());
+	choice.assign(m_alive.size(), -1);
+
+	// Идём с конца текста и для каждой вершины находим лучшее продолжение
+	for (int node = m_alive.size() - 1; node >= 0; --node) {
+		if (!m_alive[node])
+			continue;
+		if (isEndNode(node)) {
+			best[node] = 0;
+			continue;
+		}
+		for (int i = m_arcBegin[node]; i < m_arcBegin[node + 1]; ++i) {
+			const Arc& arc = m_arcs[i];
+			if (!m_alive[arc.to])
+				continue;
+			arcCost[i] = cost(arc.key);
+			double current = arcCost[i] + best[arc.to];
+			if (current < best[node]) {
+				best[node] = current;
+				choice[node] = i;
+			}
+		}
+	}
+}
+
+//-----------------------------------------------------------------------------
+void KeyLattice::assign(const Layout& layout, std::wstring_view text, int startLayer) {
+	m_textSize = text.size();
+	m_layerStates = layout.getLayersCount() + 1;
+	m_startLayer = startLayer;
+	if (startLayer < -1 || startLayer >= m_layerStates - 1)
+		throw std::exception();
+
+	int nodes = (m_textSize + 1) * m_layerStates;
+	m_arcBegin.assign(nodes + 1, 0);
+	m_arcs.clear();
+	m_alive.assign(nodes, 0);
+
+	const OutputsMatcher& matcher = layout.getMatcher();
+	m_matches.assign(matcher, text);
+
+	// Прямой проход: добавляем рёбра только из вершин, достижимых из начала
+	std::vector<char>& reached = m_reached;
+	reached.assign(nodes, 0);
+	reached[getStartNode()] = 1;
+	for (int pos = 0; pos < m_textSize; ++pos) {
+		for (int layer = -1; layer < m_layerStates - 1; ++layer) {
+			int node = getNode(pos, layer);
+			m_arcBegin[node] = m_arcs.size();
+			if (!reached[node])
+				continue;
+
+			for (int i = m_matches.getBegin(pos); i < m_matches.getEnd(pos); ++i) {
+				int size = matcher.getMatchSize(m_matches.get(i));
+				for (const auto& key : matcher.getMatchKeys(m_matches.get(i))) {
+					if (layer != -1 && key.layer != layer)
+						continue;
+
+					int nextLayer = layout.getNextLayer(key);
+					if (nextLayer >= m_layerStates - 1)
+						continue;
+
+					int to = getNode(pos + size, nextLayer);
+					m_arcs.push_back({key, to});
+					reached[to] = 1;
+				}
+			}
+		}
+	}
+	for (int node = m_textSize * m_layerStates; node <= nodes; ++node)
+		m_arcBegin[node] = m_arcs.size();
+
+	// Обратный проход: оставляем только вершины, из которых можно дойти до конца текста
+	for (int node = nodes - 1; node >= 0; --node) {
+		if (isEndNode(node)) {
+			m_alive[node] = reached[node];
+			continue;
+		}
+		for (int i = m_arcBegin[node]; i < m_arcBegin[node + 1]; ++i) {
+			if (m_alive[m_arcs[i].to]) {
+				m_alive[node] = 1;
+				break;
+			}
+		}
+	}
+}
+
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+
+//-----------------------------------------------------------------------------
+KeyVariants::KeyVariants(const KeyLattice& lattice) : m_lattice(lattice) {
+	if (m_lattice.isTypable()) {
+		int start = m_lattice.getStartNode();
+		m_stack.push_back({start, m_lattice.m_arcBegin[start]});
+		findNext();
+	}
+}
+
+//-----------------------------------------------------------------------------
+KeyVariants& KeyVariants::operator++(int) {
+	if (isEnd())
+		return *this;
+	m_stack.pop_back();
+	if (!m_keys.empty())
+		m_keys.pop_back();
+	findNext();
+	return *this;
+}
+
+//-----------------------------------------------------------------------------
+bool KeyVariants::isEnd(void) const {
+	return m_stack.empty();
+}
+
+//-----------------------------------------------------------------------------
+const Keys& KeyVariants::get(void) const {
+	return m_keys;
+}
+
+//-----------------------------------------------------------------------------
+void KeyVariants::findNext(void) {
+	while (!m_stack.empty()) {
+		int node = m_stack.back().first;
+		int& arc = m_stack.back().second;
+		int arcEnd = m_lattice.m_arcBegin[node + 1];
+
+		if (m_lattice.isEndNode(node))
+			return;
+
+		while (arc < arcEnd && !m_lattice.m_alive[m_lattice.m_arcs[arc].to])
+			arc++;
+
+		if (arc == arcEnd) {
+			m_stack.pop_back();
+			if (!m_keys.empty())
+				m_keys.pop_back();
+		} else {
+			const KeyLattice::Arc& next = m_lattice.m_arcs[arc];
+			arc++;
+			m_keys.push_back(next.key);
+			m_stack.push_back({next.to, m_lattice.m_arcBegin[next.to]});
+		}
+	}
+}
+
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+
+//-----------------------------------------------------------------------------
+bool decomposeToKeys(const Layout& layout, const std::wstring& text, int maxOneHandSize, int& symbolsCount, const KeysVisitor& visitor) {
+	KeyLattice lattice = buildFirstPartLattice(layout, text, maxOneHandSize, symbolsCount);
+	KeyVariants variants(lattice);
+	while (!variants.isEnd()) {
+		if (!visitor(variants.get()))
+			return false;
+		variants++;
+	}
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+Taps typeTextOptimal(const Layout& layout, std::wstring_view text, const PhysicalState& state, const TapTransitionCost& cost, double& resultCost) {
+	BeamStats stats;
+	return typeTextOptimal(layout, text, state, cost, 0, resultCost, stats);
+}
+
+//-----------------------------------------------------------------------------
+Taps typeTextOptimal(const Layout& layout, std::wstring_view text, const PhysicalState& state, const TapTransitionCost& cost, int beamWidth, double& resultCost, BeamStats& stats) {
+	if (beamWidth < 0)
+		throw std::exception();
+	resultCost = std::numeric_limits<double>::infinity();
+	int textSize = text.size();
+
+	const OutputsMatcher& matcher = layout.getMatcher();
+	TextMatches matches;
+	matches.assign(matcher, text);
+
+	struct StateKey
+	{
+		PhysicalState 	state;
+		int 			lastFinger;
+
+		bool operator==(const StateKey& other) const {
+			return lastFinger == other.lastFinger && state == other.state;
+		}
+	};
+
+	struct StateKeyHash
+	{
+		std::size_t operator()(const StateKey& key) const {
+			return key.state.getHash() * 31 + key.lastFinger;
+		}
+	};
+
+	// Состояние, до которого уже дошли, но которое ещё не продолжено
+	struct Pending
+	{
+		double 	cost;
+		int 	parent; // Обратная ссылка на продолжённое состояние
+		Tap 	tap; // Нажатие, по которому пришли из parent
+		bool 	done;
+	};
+
+	// Обратная ссылка продолжённого состояния, только они нужны для восстановления пути
+	struct Link
+	{
+		int 	parent;
+		Tap 	tap;
+	};
+
+	// Клавиша дотягивается не дальше чем на самый длинный вывод вперёд, поэтому хватает кольца из стольких позиций плюс текущая
+	typedef std::unordered_map<StateKey, Pending, StateKeyHash> Frontier;
+	std::vector<Frontier> frontiers(std::max(matcher.getMaxMatchSize(), 1) + 1);
+	std::vector<Link> links;
+
+	// Возвращает состояние, если оно добавлено или улучшено, иначе nullptr
+	auto relax = [&] (int pos, const StateKey& key, double nextCost, int parent, Tap tap) -> Frontier::value_type* {
+		Frontier& frontier = frontiers[pos % frontiers.size()];
+		auto found = frontier.find(key);
+		if (found == frontier.end())
+			return &*frontier.insert({key, {nextCost, parent, tap, false}}).first;
+		Pending& pending = found->second;
+		if (pending.done || nextCost >= pending.cost)
+			return nullptr;
+		pending = {nextCost, parent, tap, false};
+		return &*found;
+	};
+
+	// Ссылки, из которых уже не достижимо ни одно ожидающее состояние, выбрасываются, а остальные сдвигаются к началу. Родитель всегда продолжен раньше потомка, поэтому порядок сохраняется.
+	std::vector<int> remap;
+	std::size_t liveLinks = 0;
+	auto compactLinks = [&] () {
+		remap.assign(links.size(), -1);
+		for (auto& frontier : frontiers)
+			for (auto& i : frontier)
+				for (int link = i.second.parent; link != -1 && remap[link] == -1; link = links[link].parent)
+					remap[link] = 0;
+
+		int size = 0;
+		for (int i = 0; i < links.size(); ++i) {
+			if (remap[i] == -1)
+				continue;
+			remap[i] = size;
+			int parent = links[i].parent;
+			links[size++] = {parent == -1 ? -1 : remap[parent], links[i].tap};
+		}
+		links.resize(size);
+		for (auto& frontier : frontiers)
+			for (auto& i : frontier)
+				if (i.second.parent != -1)
+					i.second.parent = remap[i.second.parent];
+		liveLinks = size;
+	};
+
+	const std::uint16_t* fingerIds = layout.getFingerIds();
+	typedef std::pair<double, int> QueueItem;
+	std::priority_queue<QueueItem, std::vector<QueueItem>, std::greater<QueueItem>> queue;
+	std::vector<Frontier::value_type*> queued; // Состояние по номеру в очереди текущей позиции
+
+	relax(0, {state, NO_FINGER_ID}, 0, -1, {0, PRESS_ONCE});
+	int end = -1;
+	double endCost = 0;
+	for (int pos = 0; pos <= textSize && end == -1; ++pos) {
+		Frontier& frontier = frontiers[pos % frontiers.size()];
+		queued.clear();
+		for (auto& i : frontier) {
+			queue.push({i.second.cost, int(queued.size())});
+			queued.push_back(&i);
+		}
+
+		// Внутри позиции переходы не двигают текст, поэтому здесь работает алгоритм Дейкстры
+		auto relaxHere = [&] (const StateKey& key, double nextCost, int parent, Tap tap) {
+			Frontier::value_type* item = relax(pos, key, nextCost, parent, tap);
+			if (item != nullptr) {
+				queue.push({nextCost, int(queued.size())});
+				queued.push_back(item);
+			}
+		};
+
+		// Состояния достаются из очереди от дешёвых к дорогим, поэтому луч — это первые beamWidth из них
+		stats.positions++;
+		int settled = 0;
+		while (!queue.empty()) {
+			double currentCost = queue.top().first;
+			Frontier::value_type& item = *queued[queue.top().second];
+			queue.pop();
+			if (item.second.done || currentCost != item.second.cost)
+				continue;
+			if (beamWidth != 0 && settled == beamWidth) {
+				stats.truncatedPositions++;
+				stats.dropped += frontier.size() - settled;
+				break;
+			}
+			item.second.done = true;
+			settled++;
+			stats.settled++;
+
+			int current = links.size();
+			links.push_back({item.second.parent, item.second.tap});
+			stats.maxLinks = std::max<long long>(stats.maxLinks, links.size());
+			if (pos == textSize) {
+				end = current;
+				endCost = currentCost;
+				break;
+			}
+
+			const StateKey key = item.first;
+			PhysicalState probe = key.state;
+			int layer = probe.getCurrentLayer();
+
+			// Набираем клавишу, вывод которой совпадает с текстом
+			for (int i = matches.getBegin(pos); i < matches.getEnd(pos); ++i) {
+				int size = matcher.getMatchSize(matches.get(i));
+				for (const auto& matchKey : matcher.getMatchKeys(matches.get(i))) {
+					if (matchKey.layer != layer)
+						continue;
+					Tap tap = {matchKey.key, PRESS_ONCE};
+					PhysicalState next = key.state;
+					if (applyTap(layout, tap, text.substr(pos, size), next))
+						relax(pos + size, {next, fingerIds[tap.key]}, currentCost + cost(tap, key.lastFinger), current, tap);
+				}
+			}
+
+			// Переключаем слой или отпускаем зажатую клавишу, оставаясь в той же позиции. Отпускание не меняет палец предыдущего нажатия.
+			visitSilentTaps(layout, key.state, true, [&] (const Tap& tap, const PhysicalState& next) {
+				int lastFinger = (tap.press == PRESS_UP) ? key.lastFinger : fingerIds[tap.key];
+				relaxHere({next, lastFinger}, currentCost + cost(tap, key.lastFinger), current, tap);
+			});
+		}
+
+		queue = {};
+		frontier.clear();
+		if (end == -1 && links.size() >= 2 * liveLinks + 1024)
+			compactLinks();
+	}
+
+	if (end == -1)
+		return {};
+
+	Taps result;
+	for (int link = end; links[link].parent != -1; link = links[link].parent)
+		result.push_back(links[link].tap);
+	std::reverse(result.begin(), result.end());
+	resultCost = endCost;
+	return result;
+}
+
+//-----------------------------------------------------------------------------
+BeamQuality compareBeamWithExact(const Layout& layout, const std::vector<std::wstring>& sample, const PhysicalState& state, const TapTransitionCost& cost, int beamWidth, BeamStats& stats) {
+	BeamQuality result;
+	for (const auto& text : sample) {
+		double exactCost, beamCost;
+		typeTextOptimal(layout, text, state, cost, exactCost);
+		if (exactCost == std::numeric_limits<double>::infinity())
+			continue;
+
+		typeTextOptimal(layout, text, state, cost, beamWidth, beamCost, stats);
+		result.samplesCount++;
+		result.exactCost += exactCost;
+		if (beamCost == std::numeric_limits<double>::infinity()) {
+			result.failedCount++;
+			continue;
+		}
+		result.beamCost += beamCost;
+		if (beamCost > exactCost)
+			result.worseCount++;
+	}
+	return result;
+}
+
+};
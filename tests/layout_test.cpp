@@ -1,8 +1,14 @@
 ﻿#define CATCH_CONFIG_MAIN
 
+#include <set>
+#include <cstdlib>
+
 #include "catch.hpp"
 
+#include <kbd/combinatorics.h>
 #include <kbd/keyboard.h>
+#include <kbd/lattice.h>
+#include <kbd/corpus.h>
 #include "keyboards.h"
 
 using namespace kbd;
@@ -19,6 +25,12 @@ TEST_CASE("getSymbols, getKeys, getLayerKeys") {
 	CHECK(layout.getSymbols({3, 8}) == L"the");
 	CHECK(layout.getSymbols({3, 5}) == L"⓪");
 	CHECK(layout.getSymbols({3, 1}) == L"Й");
+	CHECK(layout.getSymbols({0, 7}) == L". ①");
+	CHECK(layout.getOutput({0, 7}) == L". ");
+	CHECK(layout.getNextLayer({0, 7}) == 1);
+	CHECK(layout.getNextLayer({3, 8}) == -1);
+	CHECK(layout.isLayerKey({3, 5}));
+	CHECK(!layout.isLayerKey({0, 7}));
 
 	// getKeys
 	CHECK(layout.getKeys(L't').size() == 2);
@@ -27,6 +39,10 @@ TEST_CASE("getSymbols, getKeys, getLayerKeys") {
 	CHECK(layout.getKeys(L'I').size() == 1);
 	CHECK(layout.getKeys(L',').size() == 2);
 	CHECK(layout.getKeys(L' ').size() == 3);
+	CHECK(layout.getKeys(L'Й').size() == 1);
+	CHECK(layout.getKeys(L'①').size() == 1);
+	CHECK(layout.getKeys(L'#').empty());
+	CHECK(layout.getKeys(L'ж').empty());
 
 	auto isKeyPosesEqual = [] (const KeyPoses& a, const KeyPoses& b) -> bool {
 		if (a.size() != b.size())
@@ -69,6 +85,93 @@ TEST_CASE("getSymbols, getKeys, getLayerKeys") {
 	compareKeyPosesArrays(layout.getLayerKeys(2, 1), {{5, 5, 5}});
 	compareKeyPosesArrays(layout.getLayerKeys(3, 1), {{5, 5}});
 	compareKeyPosesArrays(layout.getLayerKeys(3, 2), {{5, 9}, {5, 5, 0}});
+
+	// Самый короткий переход первый
+	CHECK(layout.getLayerKeys(0, 2)[0] == KeyPoses({9}));
+	CHECK(layout.getLayerKeys(1, 2)[0] == KeyPoses({0}));
+	CHECK(layout.getLayerKeys(1, 0)[0] == KeyPoses({4, 5}));
+	CHECK(layout.getLayerKeys(0, 0).empty());
+	CHECK(layout.getLayerKeys(0, 100).empty());
+	CHECK(layout.getLayerKeys(-1, 0).empty());
+
+	// Восемь путей из 0 в слой 12 идут через слой 1 и дальше не продолжаются, так как из 12 в 13 можно попасть только через 1. Девятый путь через слой 10 продолжается, и его нельзя терять из-за того, что слой 12 уже много раз встречался.
+	std::vector<Layout::LayoutSymbols> shared = {
+		{{0, 0}, L"①"}, {{0, 1}, L"⑩"},
+		{{1, 0}, L"②"}, {{1, 1}, L"③"}, {{1, 2}, L"④"}, {{1, 3}, L"⑤"},
+		{{1, 4}, L"⑥"}, {{1, 5}, L"⑦"}, {{1, 6}, L"⑧"}, {{1, 7}, L"⑨"},
+		{{1, 8}, L"⑬"},
+		{{10, 0}, L"⑪"}, {{11, 0}, L"⑫"}, {{12, 0}, L"①"}, {{13, 0}, L"a"}
+	};
+	for (int i = 2; i <= 9; ++i)
+		shared.push_back({{i, 0}, L"⑫"});
+	Layout sharedLayout(tenkey, shared);
+	compareKeyPosesArrays(sharedLayout.getLayerKeys(0, 13), {{0, 8}, {1, 0, 0, 0, 8}});
+}
+
+//-----------------------------------------------------------------------------
+TEST_CASE("OutputsMatcher") {
+	Keyboard tenkey("tenkey", tenkeyKeys);
+	Layout layout(tenkey, tenkeyLayout1);
+	const OutputsMatcher& matcher = layout.getMatcher();
+
+	// Для каждого совпадения запоминаем позицию начала, длину и число клавиш
+	std::wstring text = L"the, d. ";
+	std::vector<std::tuple<int, int, int>> found;
+	int state = matcher.getStartState();
+	for (int end = 0; end < text.size(); ++end) {
+		state = matcher.next(state, text[end]);
+		for (int match = matcher.getFirstMatch(state); match != -1; match = matcher.getNextMatch(match)) {
+			int size = matcher.getMatchSize(match);
+			found.push_back({end + 1 - size, size, int(matcher.getMatchKeys(match).size())});
+		}
+	}
+	auto isFound = [&found] (int pos, int size, int keys) {
+		return std::find(found.begin(), found.end(), std::make_tuple(pos, size, keys)) != found.end();
+	};
+
+	CHECK(isFound(0, 3, 2)); // the
+	CHECK(isFound(1, 1, 1)); // h
+	CHECK(isFound(3, 2, 1)); // ", "
+	CHECK(isFound(3, 1, 1)); // ,
+	CHECK(isFound(4, 1, 2)); // пробел, без " - "
+	CHECK(isFound(6, 2, 1)); // ". ①" без символа слоя
+	CHECK(!isFound(0, 1, 1)); // t отдельно нет
+	CHECK(found.size() == 10);
+}
+
+//-----------------------------------------------------------------------------
+TEST_CASE("Keyboard getKeys") {
+	Keyboard tenkey("tenkey", tenkeyKeys);
+
+	CHECK(tenkey.getKeys(HAND_ANY, FINGER_ANY, ROW_ANY, COLUMN_ANY).size() == 10);
+	CHECK(tenkey.getKeys(HAND_LEFT, FINGER_ANY, ROW_ANY, COLUMN_ANY) == KeyPoses({0, 1, 2, 3, 4}));
+	CHECK(tenkey.getKeys(HAND_ANY, FINGER_THUMB, ROW_ANY, COLUMN_ANY) == KeyPoses({4, 5}));
+	CHECK(tenkey.getKeys(HAND_RIGHT, FINGER_PINKY, ROW_MIDDLE, COLUMN_MIDDLE) == KeyPoses({9}));
+	CHECK(tenkey.getKeys(HAND_ANY, FINGER_ANY, ROW_UPPER, COLUMN_ANY).empty());
+}
+
+//-----------------------------------------------------------------------------
+TEST_CASE("getLayer") {
+	CHECK(*getLayer(L'⓪') == 0);
+	CHECK(*getLayer(L'①') == 1);
+	CHECK(*getLayer(L'⑳') == 20);
+	CHECK(*getLayer(L'㉑') == 21);
+	CHECK(*getLayer(L'㉟') == 35);
+	CHECK(*getLayer(L'㊱') == 36);
+	CHECK(*getLayer(L'㊿') == 50);
+	CHECK(!getLayer(L'a'));
+	CHECK(!getLayer(L'ⓐ'));
+	CHECK(!getLayer(L'㉠'));
+
+	for (int i = 0; i < MAX_LAYERS_COUNT; ++i)
+		CHECK(*getLayer(getLayerSymbol(i)) == i);
+	CHECK_THROWS(getLayerSymbol(MAX_LAYERS_COUNT));
+
+	std::wstring text = L"a①" + std::wstring(70, L'b') + L"㊿";
+	auto markers = getLayerMarkers(text);
+	REQUIRE(markers.size() == 2);
+	CHECK(markers[0] == 2);
+	CHECK(markers[1] == std::uint64_t(1) << 8);
 }
 
 //-----------------------------------------------------------------------------
@@ -125,4 +228,665 @@ TEST_CASE("typeTaps") {
 		{1, PRESS_ONCE}
 	};
 	CHECK(layout.typeTaps(taps, state) == L"aa. ,b");
-}
\ No newline at end of file
+
+	// Вариант без исключений
+	std::wstring output;
+	auto typeTapsFast = [&] (const Taps& taps) {
+		output.clear();
+		PhysicalState state(0);
+		return layout.typeTaps(taps, state, output);
+	};
+
+	TypeResult result = typeTapsFast({{0, PRESS_ONCE}, {5, PRESS_DOWN}, {9, PRESS_ONCE}, {5, PRESS_UP}});
+	CHECK(result.error == TYPE_OK);
+	CHECK(result.tap == -1);
+	CHECK(output == L"aD");
+
+	result = typeTapsFast({{5, PRESS_DOWN}, {5, PRESS_DOWN}});
+	CHECK(result.error == TYPE_ERROR_BUSY_FINGER_DOWN);
+	CHECK(result.tap == 1);
+
+	result = typeTapsFast({{0, PRESS_DOWN}});
+	CHECK(result.error == TYPE_ERROR_NOT_LAYER_KEY_DOWN);
+	CHECK(result.tap == 0);
+
+	result = typeTapsFast({{0, PRESS_ONCE}, {5, PRESS_UP}});
+	CHECK(result.error == TYPE_ERROR_WRONG_FINGER_UP);
+	CHECK(result.tap == 1);
+	CHECK(output == L"a");
+
+	result = typeTapsFast({{5, PRESS_DOWN}, {5, PRESS_ONCE}});
+	CHECK(result.error == TYPE_ERROR_BUSY_FINGER_PRESS);
+	CHECK(result.tap == 1);
+}
+
+//-----------------------------------------------------------------------------
+TEST_CASE("decomposeToTaps") {
+	Keyboard tenkey("tenkey", tenkeyKeys);
+	Layout layout(tenkey, tenkeyLayout1);
+	TapCost unit = [] (const Tap& tap) -> double {
+		return 1;
+	};
+	auto isTapsEqual = [] (const Taps& a, const Taps& b) {
+		if (a.size() != b.size())
+			return false;
+		for (int i = 0; i < a.size(); ++i)
+			if (a[i].key != b[i].key || a[i].press != b[i].press)
+				return false;
+		return true;
+	};
+	double cost;
+
+	// Одна клавиша на другом слое — однократное переключение
+	Keys keys = {{1, 1}};
+	Taps taps = decomposeToTaps(layout, keys, PhysicalState(0), unit, cost);
+	CHECK(cost == 2);
+	CHECK(isTapsEqual(taps, {{5, PRESS_ONCE}, {1, PRESS_ONCE}}));
+
+	// Несколько клавиш на другом слое — слой выгоднее зажать
+	keys = {{1, 1}, {1, 2}, {1, 3}};
+	taps = decomposeToTaps(layout, keys, PhysicalState(0), unit, cost);
+	CHECK(cost == 4);
+	CHECK(isTapsEqual(taps, {{5, PRESS_DOWN}, {1, PRESS_ONCE}, {2, PRESS_ONCE}, {3, PRESS_ONCE}}));
+	PhysicalState state(0);
+	CHECK(layout.typeTaps(taps, state) == L"ABC");
+
+	// Зажатую клавишу слоя надо отпустить, чтобы вернуться на предыдущий слой
+	state = PhysicalState(0);
+	state.busyFinger(HAND_RIGHT, FINGER_THUMB, 5, 1);
+	keys = {{1, 1}, {0, 0}};
+	taps = decomposeToTaps(layout, keys, state, unit, cost);
+	CHECK(cost == 3);
+	CHECK(isTapsEqual(taps, {{1, PRESS_ONCE}, {5, PRESS_UP}, {0, PRESS_ONCE}}));
+
+	// Набор через переключение по нескольким слоям совпадает с typeKeys
+	keys = {{0, 0}, {2, 9}, {3, 8}, {1, 1}, {0, 7}, {1, 9}};
+	taps = decomposeToTaps(layout, keys, PhysicalState(0), unit, cost);
+	state = PhysicalState(0);
+	CHECK(layout.typeTaps(taps, state) == layout.typeKeys(keys));
+
+	CHECK(decomposeToTaps(layout, keys, state).size() == 1);
+}
+
+//-----------------------------------------------------------------------------
+TEST_CASE("TapsStream") {
+	Keyboard tenkey("tenkey", tenkeyKeys);
+	Layout layout(tenkey, tenkeyLayout1);
+
+	// Зажатые клавиши и слой переходят через границу порций
+	Taps all = {
+		{0, PRESS_ONCE}, {7, PRESS_ONCE}, {2, PRESS_ONCE}, {5, PRESS_DOWN},
+		{0, PRESS_DOWN}, {9, PRESS_ONCE}, {5, PRESS_UP}, {0, PRESS_UP}
+	};
+	std::wstring text;
+	auto sink = [&text] (std::wstring_view part) { text += part; };
+
+	int pos = 0;
+	auto source = [&] (Taps& taps) {
+		if (pos >= all.size())
+			return false;
+		taps.assign(all.begin() + pos, all.begin() + std::min<int>(pos + 3, all.size()));
+		pos += 3;
+		return true;
+	};
+
+	PhysicalState state(0);
+	TypeResult result = typeTaps(layout, source, state, sink);
+	CHECK(result.error == TYPE_OK);
+	CHECK(text == L"a. B{}");
+	CHECK(state == PhysicalState(0));
+
+	// Номер ошибочного нажатия считается от начала потока
+	text.clear();
+	TapsStream stream(layout, PhysicalState(0), sink);
+	CHECK(stream.write({{0, PRESS_ONCE}, {5, PRESS_DOWN}}).error == TYPE_OK);
+	result = stream.write({{9, PRESS_ONCE}, {0, PRESS_UP}});
+	CHECK(result.error == TYPE_ERROR_WRONG_FINGER_UP);
+	CHECK(result.tap == 3);
+	CHECK(text == L"aD");
+	CHECK(stream.write({{0, PRESS_ONCE}}).tap == 3);
+	CHECK(stream.getTapsCount() == 3);
+}
+
+//-----------------------------------------------------------------------------
+TEST_CASE("PhysicalState") {
+	PhysicalState state(0);
+	CHECK(!state.isFingerBusy(HAND_LEFT, FINGER_THUMB));
+
+	state.busyFinger(HAND_LEFT, FINGER_THUMB, 5, 1);
+	state.busyFinger(HAND_RIGHT, FINGER_PINKY, 7, 2);
+	CHECK(*state.isFingerBusy(HAND_LEFT, FINGER_THUMB) == 5);
+	CHECK(state.getBusyMask() == ((1 << 4) | (1 << 5)));
+	CHECK(state.getCurrentLayer() == 2);
+	CHECK_THROWS(state.busyFinger(HAND_LEFT, FINGER_THUMB, 6, 3));
+
+	// Копия независима от оригинала
+	PhysicalState copy = state;
+	CHECK(copy == state);
+	CHECK(copy.getHash() == state.getHash());
+
+	CHECK(state.unbusyFinger(HAND_LEFT, FINGER_THUMB));
+	CHECK(!state.unbusyFinger(HAND_LEFT, FINGER_THUMB));
+	CHECK(state.getCurrentLayer() == 2);
+	CHECK(copy != state);
+	CHECK(*copy.isFingerBusy(HAND_LEFT, FINGER_THUMB) == 5);
+
+	// Одинаковые состояния, полученные разными путями, равны
+	PhysicalState other(0);
+	other.busyFinger(HAND_RIGHT, FINGER_PINKY, 7, 2);
+	CHECK(other == state);
+	CHECK(std::hash<PhysicalState>()(other) == std::hash<PhysicalState>()(state));
+
+	CHECK(state.unbusyFinger(HAND_RIGHT, FINGER_PINKY));
+	CHECK(state.getCurrentLayer() == 0);
+	CHECK(state == PhysicalState(0));
+}
+
+//-----------------------------------------------------------------------------
+TEST_CASE("decomposeToKeys") {
+	Keyboard tenkey("tenkey", tenkeyKeys);
+	Layout layout(tenkey, tenkeyLayout1);
+	int symbolsCount;
+	std::vector<Keys> variants;
+
+	// Клавиша с несколькими символами не может быть разрезана
+	variants = decomposeToKeys(layout, L"the", 10, symbolsCount);
+	CHECK(symbolsCount == 3);
+	CHECK(variants.size() == 2);
+	for (const auto& i : variants)
+		CHECK(layout.typeKeys(i) == L"the");
+
+	variants = decomposeToKeys(layout, L"dab the", 10, symbolsCount);
+	CHECK(symbolsCount == 4);
+	CHECK(variants.size() == 2);
+	for (const auto& i : variants)
+		CHECK(layout.typeKeys(i) == L"dab ");
+
+	// Перебор по одному с досрочной остановкой
+	int visited = 0;
+	bool isFinished = decomposeToKeys(layout, L"dab the", 10, symbolsCount, [&] (const Keys& keys) -> bool {
+		CHECK(layout.typeKeys(keys) == L"dab ");
+		visited++;
+		return false;
+	});
+	CHECK(!isFinished);
+	CHECK(visited == 1);
+
+	// Длина однорукой части находится без перебора вариантов
+	std::wstring text;
+	for (int i = 0; i < 100; ++i)
+		text += L"dcab";
+	text += L"the";
+	variants = decomposeToKeys(layout, text, 1000, symbolsCount);
+	CHECK(symbolsCount == 400);
+	CHECK(variants.size() == 1);
+	variants = decomposeToKeys(layout, text, 10, symbolsCount);
+	CHECK(symbolsCount == 10);
+
+	// Символ, которого нет в раскладке, не заставляет часть расти до конца текста
+	text = L"#";
+	for (int i = 0; i < 20000; ++i)
+		text += L"ab ";
+	KeyLattice lattice = buildFirstPartLattice(layout, text, 10, symbolsCount);
+	CHECK(!lattice.isTypable());
+	CHECK(symbolsCount == 1);
+	CHECK(decomposeToKeys(layout, text, 10, symbolsCount).empty());
+}
+
+//-----------------------------------------------------------------------------
+TEST_CASE("KeyLattice") {
+	Keyboard tenkey("tenkey", tenkeyKeys);
+	Layout layout(tenkey, tenkeyLayout1);
+
+	// После `. ①` следующая клавиша обязана быть на первом слое
+	KeyLattice lattice(layout, L"a. B");
+	CHECK(lattice.isTypable());
+	CHECK(lattice.getVariantsCount() == 3);
+	for (const auto& i : lattice.getAllVariants())
+		CHECK(layout.typeKeys(i) == L"a. B");
+
+	CHECK(KeyLattice(layout, L"a. b").getVariantsCount() == 2);
+	CHECK(!KeyLattice(layout, L"a#").isTypable());
+
+	// Самый дешевый вариант: клавиши на нулевом слое бесплатны
+	double cost;
+	Keys keys = KeyLattice(layout, L"a, the").getOptimal([] (const Key& key) -> double {
+		return key.layer;
+	}, cost);
+	CHECK(cost == 0);
+	CHECK(layout.typeKeys(keys) == L"a, the");
+	CHECK(keys.size() == 3);
+
+	// Лишний шаг после конца перебора ничего не делает
+	KeyVariants variants(lattice);
+	int count = 0;
+	for (; !variants.isEnd(); variants++)
+		count++;
+	CHECK(count == 3);
+	variants++;
+	CHECK(variants.isEnd());
+}
+
+//-----------------------------------------------------------------------------
+TEST_CASE("Number") {
+	// Код Грея проходит каждое значение ровно один раз, и на каждом шаге меняется ровно одна цифра на единицу
+	std::vector<int> base = {3, 1, 2, 4};
+	Number num(base, NUMBER_GRAY);
+	CHECK(num.getChangedDigit() == -1);
+	std::set<std::vector<int>> values;
+	std::vector<int> previous = num.get();
+	int wrongSteps = 0;
+	do {
+		const auto& mas = num.get();
+		values.insert(mas);
+		if (values.size() > 1) {
+			int changed = num.getChangedDigit();
+			for (int i = 0; i < mas.size(); ++i)
+				if (i == changed ? std::abs(mas[i] - previous[i]) != 1 : mas[i] != previous[i])
+					wrongSteps++;
+		}
+		previous = mas;
+		num++;
+	} while (!num.isEnd());
+	CHECK(values.size() == 3 * 1 * 2 * 4);
+	CHECK(wrongSteps == 0);
+
+	// При обычном счёте самая старшая поменявшаяся цифра
+	Number counting(2, 3);
+	counting++;
+	CHECK(counting.getChangedDigit() == 0);
+	counting++;
+	CHECK(counting.getChangedDigit() == 1);
+	CHECK(counting.get() == std::vector<int>({0, 1, 0}));
+}
+
+//-----------------------------------------------------------------------------
+TEST_CASE("Compositions") {
+	// Исходный перебор: двоичное число из sum - 1 цифр считается от нуля, единица в цифре i означает, что элементы i и i + 1 в одной части
+	auto countingComposition = [] (int sum, std::uint64_t value) {
+		std::vector<int> result(1, 1);
+		for (int i = 0; i < sum - 1; ++i) {
+			if (value & (std::uint64_t(1) << i))
+				result.back()++;
+			else
+				result.push_back(1);
+		}
+		return result;
+	};
+
+	// Суммы до таблицы, на её границе и больше неё, когда части считаются в буфере
+	for (int sum : {1, 2, 5, 8, 9, 10, 13}) {
+		std::uint64_t count = 0;
+		int mismatches = 0;
+		std::vector<unsigned char> buffer(sum);
+		Compositions comp(sum);
+		do {
+			std::vector<int> parts = comp.get();
+			mismatches += parts != countingComposition(sum, count) || parts.size() != comp.getPartsCount();
+
+			int partsCount = getCompositionParts(sum, comp.getSplits(), buffer.data());
+			mismatches += std::vector<int>(buffer.begin(), buffer.begin() + partsCount) != parts;
+			if (sum <= COMPOSITIONS_TABLE_SUM) {
+				const TableComposition& table = getTableComposition(sum, comp.getSplits());
+				mismatches += std::vector<int>(table.parts, table.parts + table.count) != parts;
+			}
+
+			count++;
+			comp++;
+		} while (!comp.isEnd());
+		CHECK(mismatches == 0);
+		CHECK(count == (std::uint64_t(1) << (sum - 1)));
+	}
+
+	// Копия не зависит от исходного перебора, даже когда части лежат во внутреннем буфере
+	for (int sum : {5, 12, 64}) {
+		Compositions* source = new Compositions(sum);
+		for (int i = 0; i < 37; ++i)
+			(*source)++;
+		Compositions copy = *source;
+		std::vector<int> parts = source->get();
+		delete source;
+		CHECK(copy.get() == parts);
+		copy++;
+		std::vector<unsigned char> buffer(sum);
+		int partsCount = getCompositionParts(sum, copy.getSplits(), buffer.data());
+		CHECK(copy.get() == std::vector<int>(buffer.begin(), buffer.begin() + partsCount));
+	}
+
+	CHECK_THROWS(Compositions(0));
+	CHECK_THROWS(Compositions(65));
+}
+
+//-----------------------------------------------------------------------------
+TEST_CASE("decomposeOneHandAccords") {
+	Keyboard tenkey("tenkey", tenkeyKeys);
+
+	CHECK(decomposeOneHandAccords(tenkey, {0, 1, 2}).size() == 3);
+	CHECK(decomposeOneHandAccords(tenkey, {0, 0, 1}).size() == 1);
+	CHECK(decomposeOneHandAccords(tenkey, {0, 0, 1})[0] == Accords({{0}, {0, 1}}));
+
+	// Второй раз результат берется из таблицы по последовательности пальцев
+	CHECK(decomposeOneHandAccords(tenkey, {0, 1, 2}).size() == 3);
+	CHECK(decomposeOneHandAccords(tenkey, {9, 8, 7}).size() == 3);
+	CHECK(decomposeOneHandAccords(tenkey, {9, 8, 7})[0] == Accords({{9, 8}, {7}}));
+
+	// Мизинцы разных рук — разные пальцы, поэтому в таблице у них разные записи
+	CHECK(decomposeOneHandAccords(tenkey, {0, 0}) == std::vector<Accords>({{{0}, {0}}}));
+	Keyboard fresh("tenkey", tenkeyKeys);
+	CHECK(decomposeOneHandAccords(tenkey, {0, 9}) == decomposeOneHandAccords(fresh, {0, 9}));
+	CHECK(decomposeOneHandAccords(tenkey, {0, 9}) == std::vector<Accords>({{{0, 9}}}));
+}
+
+//-----------------------------------------------------------------------------
+TEST_CASE("AccordsVariants") {
+	Keyboard tenkey("tenkey", tenkeyKeys);
+	KeyPoses keyPoses = {0, 1, 2, 6, 7, 3, 0, 8, 9};
+
+	AccordsVariants variants(tenkey, keyPoses);
+	auto all = decomposeToAccords(tenkey, keyPoses);
+	CHECK(variants.getPartsCount() == 4);
+	CHECK(variants.size() == all.size());
+	CHECK(variants.get(variants.size() - 1) == all.back());
+
+	AccordCost cost = [] (const Accord& accord) -> double {
+		return accord.size() == 2 ? 1 : 2;
+	};
+	double exhaustiveCost = std::numeric_limits<double>::infinity();
+	for (const auto& i : all) {
+		double current = 0;
+		for (const auto& j : i)
+			current += cost(j);
+		exhaustiveCost = std::min(exhaustiveCost, current);
+	}
+	double optimalCost;
+	variants.getOptimal(cost, optimalCost);
+	CHECK(optimalCost == exhaustiveCost);
+}
+
+//-----------------------------------------------------------------------------
+TEST_CASE("Branch and bound") {
+	Keyboard tenkey("tenkey", tenkeyKeys);
+	Layout layout(tenkey, tenkeyLayout1);
+	SearchStats stats;
+	double cost;
+
+	// Аккорды: длинные аккорды дешевле, одиночные нажатия дороже
+	AccordCost accordCost = [] (const Accord& accord) -> double {
+		return 1.0 + 1.0 / accord.size();
+	};
+	KeyPoses keyPoses = {0, 1, 2, 2, 3, 6, 7, 8, 8, 8, 9};
+	double exhaustiveCost = std::numeric_limits<double>::infinity();
+	for (const auto& i : decomposeToAccords(tenkey, keyPoses)) {
+		double current = 0;
+		for (const auto& j : i)
+			current += accordCost(j);
+		exhaustiveCost = std::min(exhaustiveCost, current);
+	}
+	Accords accords = decomposeToAccords(tenkey, keyPoses, accordCost, cost, stats);
+	CHECK(cost == Approx(exhaustiveCost));
+	int size = 0;
+	for (const auto& i : accords)
+		size += i.size();
+	CHECK(size == keyPoses.size());
+
+	// Клавиши: полная стоимость — номера слоёв и число смен слоя, нижняя оценка — только номер слоя
+	stats = SearchStats();
+	KeyCost layerNumber = [] (const Key& key) -> double {
+		return key.layer;
+	};
+	KeysCost layerChanges = [&] (const Keys& keys) -> double {
+		double result = 0;
+		for (int i = 0; i < keys.size(); ++i)
+			result += layerNumber(keys[i]) + (i != 0 && keys[i].layer != keys[i - 1].layer);
+		return result;
+	};
+	KeyLattice lattice(layout, L"a, the, d. Ab");
+	double exhaustiveKeysCost = std::numeric_limits<double>::infinity();
+	for (const auto& i : lattice.getAllVariants())
+		exhaustiveKeysCost = std::min(exhaustiveKeysCost, layerChanges(i));
+	Keys keys = lattice.getOptimal(layerNumber, layerChanges, cost, stats);
+	CHECK(cost == exhaustiveKeysCost);
+	CHECK(layout.typeKeys(keys) == L"a, the, d. Ab");
+	CHECK(stats.pruned > 0);
+}
+
+//-----------------------------------------------------------------------------
+TEST_CASE("typeText") {
+	// Наборщик, для которого время набора — это число аккордов
+	class AccordsCounter : public Typer
+	{
+	public:
+		AccordsCounter(const Layout& layout) : Typer(layout) {}
+		int getOptimalAccords(const std::vector<Accords>& variants) const {
+			int best = 0;
+			for (int i = 1; i < variants.size(); ++i)
+				if (variants[i].size() < variants[best].size())
+					best = i;
+			return best;
+		}
+		double type(const Accords& accords) {
+			return accords.size();
+		}
+	};
+
+	Keyboard tenkey("tenkey", tenkeyKeys);
+	Layout layout(tenkey, tenkeyLayout1);
+	AccordsCounter typer(layout);
+
+	PhysicalState state(0);
+	std::wstring text = L"a, the. Ab{}";
+	TextTyping result = typeText(typer, text, 3, state);
+	CHECK(result.typedSize == text.size());
+	CHECK(result.time == result.accords.size());
+	CHECK(state == PhysicalState(0));
+
+	// Текст набирается до первого символа, которого нет в раскладке
+	state = PhysicalState(0);
+	result = typeText(typer, L"a, b#the", 3, state);
+	CHECK(result.typedSize == 4);
+
+	// Части нулевой длины не бывает
+	CHECK_THROWS(typeText(typer, text, 0, state));
+	CHECK_THROWS(typeText(typer, text, -1, state));
+
+	// Номер варианта от Typer проверяется
+	class WrongTyper : public AccordsCounter
+	{
+	public:
+		using AccordsCounter::AccordsCounter;
+		int getOptimalAccords(const std::vector<Accords>& variants) const {
+			return variants.size();
+		}
+	};
+	WrongTyper wrongTyper(layout);
+	state = PhysicalState(0);
+	CHECK_THROWS(typeText(wrongTyper, text, 3, state));
+}
+
+//-----------------------------------------------------------------------------
+TEST_CASE("typeCorpus") {
+	// Наборщик, для которого время набора аккорда тем больше, чем больше в нём клавиш
+	class AccordsWeigher : public Typer
+	{
+	public:
+		AccordsWeigher(const Layout& layout) : Typer(layout) {}
+		int getOptimalAccords(const std::vector<Accords>& variants) const {
+			return variants.size() - 1;
+		}
+		double type(const Accords& accords) {
+			double result = 0;
+			for (const auto& i : accords)
+				result += 0.1 * i.size() + 1.0 / 3;
+			return result;
+		}
+	};
+
+	Keyboard tenkey("tenkey", tenkeyKeys);
+	Layout layout(tenkey, tenkeyLayout1);
+	TyperFactory makeTyper = [&layout] () {
+		return std::unique_ptr<Typer>(new AccordsWeigher(layout));
+	};
+
+	// Куски режутся только между частями typeText, после пробельных символов: части здесь "ab ", "cd ", " ab"
+	CHECK(splitToChunks(layout, L"ab cd  ab", 3, 1) == std::vector<int>({0, 3, 9}));
+	CHECK(splitToChunks(layout, L"ab cd  ab", 3, 4) == std::vector<int>({0, 9}));
+	CHECK(splitToChunks(layout, L"", 3, 4) == std::vector<int>({0}));
+
+	// Выводы " - " и ", " пересекают пробелы, а после `. ①` остаётся включённый слой, но набор по кускам совпадает с набором всего текста
+	std::wstring mixed;
+	for (int i = 0; i < 40; ++i)
+		mixed += L"a. Ab - c, the. B{} bad ";
+
+	AccordsWeigher whole(layout);
+	PhysicalState wholeState(0);
+	TextTyping expected = typeText(whole, mixed, 3, wholeState);
+	CHECK(expected.typedSize == mixed.size());
+	for (int threadsCount : {1, 4}) {
+		CorpusTyping chunked = typeCorpus(makeTyper, mixed, 3, 0, 7, threadsCount);
+		CHECK(chunked.typedSize == expected.typedSize);
+		CHECK(chunked.failedChunksCount == 0);
+		CHECK(chunked.retypedChunksCount > 0);
+		CHECK(chunked.time == Approx(expected.time));
+	}
+
+	std::wstring text;
+	for (int i = 0; i < 50; ++i)
+		text += L"a, the. Ab{} bad cab ";
+
+	CorpusTyping single = typeCorpus(makeTyper, text, 3, 0, 16, 1);
+	CorpusTyping parallel = typeCorpus(makeTyper, text, 3, 0, 16, 4);
+	CHECK(single.typedSize == text.size());
+	CHECK(single.failedChunksCount == 0);
+	CHECK(single.chunksCount > 4);
+	CHECK(single.time == parallel.time);
+	CHECK(single.typedSize == parallel.typedSize);
+}
+
+//-----------------------------------------------------------------------------
+TEST_CASE("WordsCache") {
+	Keyboard tenkey("tenkey", tenkeyKeys);
+	Layout layout(tenkey, tenkeyLayout1);
+	CHECK(Layout(tenkey, tenkeyLayout1).getFingerprint() == layout.getFingerprint());
+	auto changed = tenkeyLayout1;
+	changed[0].symbols = L"z";
+	CHECK(Layout(tenkey, changed).getFingerprint() != layout.getFingerprint());
+
+	AccordCost accordsCount = [] (const Accord& accord) -> double {
+		return 1;
+	};
+	Accords accords;
+	CHECK(decomposeWord(layout, L"bad", PhysicalState(0), accordsCount, accords) == 1);
+	CHECK(decomposeWord(layout, L"b#d", PhysicalState(0), accordsCount, accords) == std::numeric_limits<double>::infinity());
+
+	WordsCache cache(accordsCount, 2);
+	WordPlan plan = cache.get(layout, L"bad", PhysicalState(0));
+	CHECK(plan.cost == 1);
+	CHECK(plan.accords.size() == 1);
+	CHECK(cache.get(layout, L"bad", PhysicalState(0)).cost == 1);
+	CHECK(cache.getHitsCount() == 1);
+	CHECK(cache.getMissesCount() == 1);
+
+	// Другое физическое состояние — другая запись
+	cache.get(layout, L"bad", PhysicalState(1));
+	CHECK(cache.getMissesCount() == 2);
+	CHECK(cache.size() == 2);
+
+	// Размер не растёт больше заданного
+	cache.get(layout, L"cab", PhysicalState(0));
+	cache.get(layout, L"the", PhysicalState(0));
+	CHECK(cache.size() == 2);
+	CHECK(cache.getMissesCount() == 4);
+}
+
+//-----------------------------------------------------------------------------
+TEST_CASE("typeTextOptimal") {
+	Keyboard tenkey("tenkey", tenkeyKeys);
+	Layout layout(tenkey, tenkeyLayout1);
+	TapTransitionCost unit = [] (const Tap& tap, int previousFinger) -> double {
+		return 1;
+	};
+	TapCost tapUnit = [] (const Tap& tap) -> double {
+		return 1;
+	};
+
+	// С одинаковой стоимостью нажатий результат совпадает с лучшим из всех вариантов клавиш
+	for (std::wstring text : {L"a, the. Ab{}", L"ABCa", L"dcab the"}) {
+		double cost, best = std::numeric_limits<double>::infinity();
+		for (const auto& keys : KeyLattice(layout, text).getAllVariants()) {
+			double current;
+			decomposeToTaps(layout, keys, PhysicalState(0), tapUnit, current);
+			best = std::min(best, current);
+		}
+
+		Taps taps = typeTextOptimal(layout, text, PhysicalState(0), unit, cost);
+		CHECK(cost == best);
+		CHECK(taps.size() == cost);
+		PhysicalState state(0);
+		CHECK(layout.typeTaps(taps, state) == text);
+	}
+
+	// Стоимость может зависеть от предыдущего пальца
+	const std::uint16_t* fingerIds = layout.getFingerIds();
+	TapTransitionCost sameFinger = [fingerIds] (const Tap& tap, int previousFinger) -> double {
+		return 1 + (tap.press != PRESS_UP && fingerIds[tap.key] == previousFinger);
+	};
+	double unitCost, cost;
+	typeTextOptimal(layout, L"aabb", PhysicalState(0), unit, unitCost);
+	Taps taps = typeTextOptimal(layout, L"aabb", PhysicalState(0), sameFinger, cost);
+	CHECK(cost >= unitCost);
+	PhysicalState state(0);
+	CHECK(layout.typeTaps(taps, state) == L"aabb");
+
+	typeTextOptimal(layout, L"a#", PhysicalState(0), unit, cost);
+	CHECK(cost == std::numeric_limits<double>::infinity());
+
+	// На каждой позиции продолжаются десятки состояний, но обратных ссылок хранится порядка длины пути
+	std::wstring text;
+	while (text.size() < 3000)
+		text += L"a, the. Ab{} dcab ABC ";
+	BeamStats stats;
+	taps = typeTextOptimal(layout, text, PhysicalState(0), unit, 0, cost, stats);
+	state = PhysicalState(0);
+	CHECK(layout.typeTaps(taps, state) == text);
+	CHECK(stats.settled > 10 * stats.maxLinks);
+	CHECK(stats.maxLinks < 3 * taps.size() + 2048);
+}
+
+//-----------------------------------------------------------------------------
+TEST_CASE("Beam search") {
+	Keyboard tenkey("tenkey", tenkeyKeys);
+	Layout layout(tenkey, tenkeyLayout1);
+	TapTransitionCost unit = [] (const Tap& tap, int previousFinger) -> double {
+		return 1;
+	};
+	std::wstring text = L"a, the. Ab{} dcab ABC";
+
+	// Без ограничения луча результат точный и ничего не отбрасывается
+	double exact, cost;
+	typeTextOptimal(layout, text, PhysicalState(0), unit, exact);
+	BeamStats stats;
+	typeTextOptimal(layout, text, PhysicalState(0), unit, 0, cost, stats);
+	CHECK(cost == exact);
+	CHECK(stats.positions > 0);
+	CHECK(stats.dropped == 0);
+
+	// Узкий луч отбрасывает состояния, но набор, если найден, остаётся правильным и не дешевле точного
+	stats = BeamStats();
+	Taps taps = typeTextOptimal(layout, text, PhysicalState(0), unit, 1, cost, stats);
+	CHECK(stats.truncatedPositions > 0);
+	CHECK(stats.dropped >= stats.truncatedPositions);
+	CHECK(cost >= exact);
+	if (!taps.empty()) {
+		PhysicalState state(0);
+		CHECK(layout.typeTaps(taps, state) == text);
+	}
+
+	stats = BeamStats();
+	BeamQuality quality = compareBeamWithExact(layout, {L"ABCa", L"the, a", L"a#", text}, PhysicalState(0), unit, 64, stats);
+	CHECK(quality.samplesCount == 3);
+	CHECK(quality.worseCount == 0);
+	CHECK(quality.failedCount == 0);
+	CHECK(quality.beamCost == quality.exactCost);
+
+	CHECK_THROWS(typeTextOptimal(layout, text, PhysicalState(0), unit, -1, cost, stats));
+}